@@ -30,8 +30,36 @@
 */
 
 #include <Python.h>
+#include <time.h>
+#include "FlexModuleAPI.h"
+#include "cSymbols.h"
 
+/*
+ * Semantic values.  Every $n is normally a Python object (or a lazy
+ * token; see below).  A grammar that defines BISONMODULE_NATIVE before
+ * including this file gets a union instead, so that its rules can
+ * compute C values as they parse and make objects of them only where
+ * they join the tree.  Each symbol is then declared with its member:
+ * %token <ob> and %type <ob> for the objects handed to REDUCE and
+ * friends, %type <d> or <l> for doubles and longs, and any members the
+ * grammar adds by defining BISONMODULE_VALUES (say, as "struct range
+ * r;").  See BOX and TOKENDOUBLE below.
+ */
+#ifdef BISONMODULE_NATIVE
+typedef union {
+  PyObject *ob;			/* Objects, and tokens */
+  double d;
+  long l;
+#ifdef BISONMODULE_VALUES
+  BISONMODULE_VALUES
+#endif
+} bisonvalue;
+#define YYSTYPE bisonvalue
+#define BM_YYLVAL yylval.ob		/* The object member of yylval */
+#else
 #define YYSTYPE PyObject *
+#define BM_YYLVAL yylval
+#endif
 YYSTYPE yylval;
 int yydebug;
 int yyparse(void);
@@ -39,8 +67,50 @@ int yyparse(void);
 static PyObject **symbolbuffer = NULL;	/* Buffer used to store
 					   symbols while generating
 					   parse tree */
-static int maxslot = 1;			/* Current size of buffer */
-static int slot;			/* Current index into buffer */
+static Py_ssize_t maxslot = 1;		/* Current size of buffer */
+static Py_ssize_t slot;			/* Current index into buffer */
+
+/*
+ * Runtime statistics.  Define BISONMODULE_STATS before including this
+ * file to compile in the counters; without it, BM_STAT expands to
+ * nothing and stats() returns an empty dictionary.  Timing of the
+ * makesymbol callback is switched on and off at run time by
+ * reset_stats().
+ */
+#ifdef BISONMODULE_STATS
+#define BM_STAT(x) (x)
+#else
+#define BM_STAT(x)
+#endif
+
+struct stats_struct {
+  long tokens;			/* Tokens pulled from readtoken */
+  long reduce;			/* Calls to REDUCE */
+  long reduceleft;		/* Calls to REDUCELEFT and APPEND */
+  long reduceright;		/* Calls to REDUCERIGHT and PREPEND */
+  long errors;			/* Syntax errors reported by the parser */
+  long recoveries;		/* Error symbols created by REDUCEERROR */
+  long materialized;		/* Lazy tokens turned into objects */
+  long shared;			/* Children replaced by an equal node */
+  long released;		/* Symbols dropped before the end */
+  Py_ssize_t highwater;		/* Most slots used in symbolbuffer */
+  int timing;			/* Time makesymbol if non-zero */
+  double makesymbol_time;	/* Seconds spent in makesymbol */
+};
+static struct stats_struct parsestats;
+
+#if defined(BISONMODULE_STATS) || defined(BISONMODULE_PROFILE)
+/*
+ * Seconds from an arbitrary starting point, for the timers.
+ */
+static double
+stats_clock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+#endif
 
 /*
  * Toolkits for using Bison (or any yacc) are a little difficult.
@@ -81,27 +151,110 @@ static int slot;			/* Current index into buffer */
  * flushed, the count is reduced to 1, and the token is returned.  If
  * the token is not incorporated into the tree, its count remains 1
  * until the buffer is flushed, then is reduced to 0 and the token is
- * freed.
+ * freed.  (Or until the buffer is swept, if that comes first; see
+ * below.)
+ */
+
+/*
+ * Grammar rule profiling.  Define BISONMODULE_PROFILE before including
+ * this file, declare %locations in the grammar, and run bison with -t
+ * so that it keeps the table of rule line numbers.
+ *
+ * Bison calls YYLLOC_DEFAULT once for each reduction, just before the
+ * rule's action; it is the one hook that sees every rule, including
+ * those whose actions never call REDUCE.  The time from there to the
+ * next reduction or the next call to yylex is charged to the rule, so
+ * it covers the action and any makesymbol calls made from it.  Error
+ * recovery also uses YYLLOC_DEFAULT, with yyerror_range as the right
+ * hand side; that is not a reduction and is not counted.  The macro
+ * itself is below, with atreduction(), which also sweeps the buffer.
  */
+struct profile_struct {
+  int nrules;			/* Size of the arrays below */
+  long *reductions;		/* Reductions, by rule number */
+  double *seconds;		/* Time charged to each rule */
+  int current;			/* Rule being timed, or 0 */
+  double start;			/* When the current rule was reduced */
+  PyObject *rules;		/* (file, line, lhs name) by rule number */
+};
+static struct profile_struct ruleprofile;
+
+#ifdef BISONMODULE_PROFILE
+/*
+ * Charge the time since the last reduction to its rule.
+ */
+static void
+profile_stop (void)
+{
+  if (ruleprofile.current) {
+    ruleprofile.seconds[ruleprofile.current] +=
+      stats_clock() - ruleprofile.start;
+    ruleprofile.current = 0;
+  }
+}
+
+/*
+ * Count a reduction and start timing its action.
+ */
+static void
+profile_reduce (int rule)
+{
+  profile_stop();
+  if (rule > 0 && rule < ruleprofile.nrules) {
+    ruleprofile.reductions[rule]++;
+    ruleprofile.current = rule;
+    ruleprofile.start = stats_clock();
+  }
+}
+
+/*
+ * Allocate the profile and remember where each rule came from; called
+ * from BISONMODULEINIT, where bison's tables are visible.
+ */
+static void
+profile_init (int nrules)
+{
+  ruleprofile.reductions = (long *) calloc(nrules, sizeof(long));
+  ruleprofile.seconds = (double *) calloc(nrules, sizeof(double));
+  ruleprofile.rules = PyTuple_New(nrules);
+  if (!ruleprofile.reductions || !ruleprofile.seconds) {
+    PyErr_NoMemory();
+    return;
+  }
+  if (ruleprofile.rules) {
+    ruleprofile.nrules = nrules;
+  }
+}
+
+static void
+profile_rule (int rule, const char * file, int line, const char * lhs)
+{
+  if (rule < ruleprofile.nrules) {
+    PyTuple_SET_ITEM(ruleprofile.rules, rule,
+		     Py_BuildValue("(s,i,s)", file, line, lhs));
+  }
+}
+#endif
 
 /*
  * Buffer management: Initialize and clear buffer
  *
  * The buffer will be dynamically resized below as needed; it is
- * initially small.
+ * initially small.  It is kept from one parse to the next, and
+ * flushbuffer leaves it all 0, so only a new buffer needs clearing.
  */
 static void
 clearbuffer (void)
 {
   if (!symbolbuffer) {		/* Allocate initial symbolbuffer */
     symbolbuffer = (PyObject **) malloc(sizeof(PyObject *) * maxslot);
-  }
-  if (!symbolbuffer) {
-    PyErr_NoMemory();
-    return;
-  }
-  for (slot = 0; slot < maxslot; slot++) {
-    symbolbuffer[slot] = 0;	/* All initial entries are 0 */
+    if (!symbolbuffer) {
+      PyErr_NoMemory();
+      return;
+    }
+    for (slot = 0; slot < maxslot; slot++) {
+      symbolbuffer[slot] = 0;	/* All initial entries are 0 */
+    }
   }
   slot = 0;			/* Reset the next slot to be used */
 }
@@ -149,7 +302,7 @@ buffersymbol (PyObject * symb)
     return;
   }
   while (slot >= maxslot) {	/* Resize the buffer */
-    int i;
+    Py_ssize_t i;
     maxslot *= 2;
     symbolbuffer =
       (PyObject **) realloc(symbolbuffer, sizeof(PyObject *) * maxslot);
@@ -164,9 +317,52 @@ buffersymbol (PyObject * symb)
   }
   symbolbuffer[slot] = symb;	/* Put the symbol in the buffer */
   slot++;			/* and go to the next slot */
+  BM_STAT(parsestats.highwater = slot > parsestats.highwater
+	  ? slot : parsestats.highwater);
   return;
 }
 
+/*
+ * The parser stack.  Bison grows its stacks on the heap, doubling them
+ * as needed, up to YYMAXDEPTH entries; its default of 10000 is soon
+ * used up by deeply parenthesized or right-recursive input.  Here
+ * YYMAXDEPTH is a variable, set by each parse() from its max_depth
+ * (BISONMODULE_MAXDEPTH by default), and running into it raises a
+ * ParserError that says so.  A grammar defining YYMAXDEPTH itself
+ * keeps that fixed limit instead.
+ */
+#ifndef BISONMODULE_MAXDEPTH
+#define BISONMODULE_MAXDEPTH 10000000
+#endif
+
+static long maxdepth = BISONMODULE_MAXDEPTH; /* Limit for this parse */
+
+#ifndef YYMAXDEPTH
+#define YYMAXDEPTH maxdepth
+#endif
+
+static int stackfailed = 0;		/* stackalloc found no memory */
+
+/*
+ * Allocate parser stack space, raising MemoryError if there is none,
+ * so that a failed allocation is not taken for reaching the limit.
+ */
+static void *
+stackalloc (size_t size)
+{
+  void *p = malloc(size);
+  if (!p) {
+    stackfailed = 1;		/* For yyerror, below */
+    PyErr_NoMemory();
+  }
+  return p;
+}
+
+#ifndef YYMALLOC
+#define YYMALLOC stackalloc
+#define YYFREE free
+#endif
+
 /*
  * Parser data.
  */
@@ -177,24 +373,672 @@ static PyObject *readtoken = NULL;	/* Function to generate tokens */
 
 static PyObject *lasttoken = NULL;      /* Last token read from scanner */
 static PyObject *errtoken = NULL;       /* Last token when yyerror called */
-static char *errmsg = NULL;	        /* Bison-generated error message */
+static char *errmsg = NULL;	        /* Pending error message, in errbuf */
 static PyObject *errsymb = NULL;        /* Most recent error symbol */
 
 static PyObject *parsetree = NULL;	/* Top node of parse tree */
+static int parsing = 0;			/* In parse(), for release() */
 
 #define SYNTAXERROR -1			/* Syntax error symbol type */
 
+/*
+ * Limits, for parsing untrusted input on a budget.  parse() may be
+ * given a deadline (a time.time() value), a number of tokens and a
+ * number of tree nodes, counted as the tree is built: each child given
+ * to REDUCE, APPEND and friends is one more node.  The clock is read
+ * once for every BISONMODULE_CLOCKEVERY tokens, nodes and calls to
+ * makesymbol.  Going over a limit raises
+ * LimitExceeded, a subclass of ParserError, and abandons the parse
+ * (see yylex), after which the parser's buffers are freed.
+ */
+#ifndef BISONMODULE_CLOCKEVERY
+#define BISONMODULE_CLOCKEVERY 64
+#endif
+
+static PyObject *LimitExceeded = NULL;	/* Exception raised at a limit */
+static double stoptime = 0;		/* Deadline, as time.time(), or 0 */
+static long maxtokens = 0;		/* Tokens allowed, or 0 for any */
+static long maxnodes = 0;		/* Nodes allowed, or 0 for any */
+static long nnodes = 0;			/* Nodes joined in this parse */
+static int nclock = 0;			/* Counted since reading the clock */
+
+/*
+ * Count a token, node or symbol against the deadline.  Returns non-zero,
+ * with LimitExceeded set, once the deadline has passed.
+ */
+static int
+pastdeadline (void)
+{
+  struct timespec ts;
+  if (!stoptime || ++nclock < BISONMODULE_CLOCKEVERY) {
+    return 0;
+  }
+  nclock = 0;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  if (ts.tv_sec + ts.tv_nsec * 1e-9 < stoptime) {
+    return 0;
+  }
+  PyErr_SetString(LimitExceeded, "parse deadline passed");
+  return 1;
+}
+
+/*
+ * Count a node joined into the tree.  Returns non-zero, with
+ * LimitExceeded set, once past the node limit or the deadline.
+ */
+static int
+countnode (void)
+{
+  if (maxnodes && ++nnodes > maxnodes) {
+    PyErr_Format(LimitExceeded, "node limit exceeded (%ld)", maxnodes);
+    return 1;
+  }
+  return pastdeadline();
+}
+
+/*
+ * Lazy tokens.
+ *
+ * Given a FlexModule scanner's scannerapi capsule in place of
+ * readtoken, parse() reads tokens through the C interface in
+ * FlexModuleAPI.h and keeps each one as a small record, its text
+ * copied into a pool, until a rule hands it to REDUCE, APPEND and
+ * friends.  Only then is maketoken called.  Tokens that the grammar
+ * throws away (newlines, parentheses, keywords) never become Python
+ * objects at all.
+ *
+ * A lazy token's $n is not a real object pointer but the index of its
+ * record, shifted left with the low bit set; objects are always
+ * aligned, so the two cannot be confused.  A rule that looks at a
+ * token itself, rather than passing it to the macros below, must use
+ * PYOBJECT($n) to get the object.
+ */
+typedef struct {
+  int type;			/* Token type */
+  Py_ssize_t text;		/* Offset of the text in lazytext */
+  Py_ssize_t len;		/* Length of the text */
+  linecol pre_line;		/* Position, as from the scanner */
+  linecol pre_col;
+  linecol cur_line;
+  linecol cur_col;
+  PyObject *context;		/* Owned reference to the context */
+  PyObject *object;		/* The token object, once made; owned
+				   by the buffer */
+} lazytoken;
+
+static ScannerAPI *scannerapi = NULL;	/* Scanner, if reading lazily */
+static lazytoken *lazytokens = NULL;	/* Token records of this parse */
+static long nlazy = 0, maxlazy = 0;
+static char *lazytext = NULL;		/* Text of the tokens */
+static Py_ssize_t lazytextlen = 0, maxlazytext = 0;
+static char *tokenbuf = NULL;		/* Copy of a token's text, for
+					   TOKENTEXT */
+static Py_ssize_t maxtokenbuf = 0;
+
+#define ISLAZY(ob)     (((Py_intptr_t) (ob)) & 1)
+#define LAZYTOKEN(i)   ((PyObject *) ((((Py_intptr_t) (i)) << 1) | 1))
+#define LAZYINDEX(ob)  (((Py_intptr_t) (ob)) >> 1)
+
+/*
+ * Return the object for a semantic value, calling maketoken for a
+ * lazy token the first time it is needed.  The buffer owns the
+ * result.
+ */
+static PyObject *
+materialize (PyObject * ob)
+{
+  lazytoken *t;
+  ScannedToken tok;
+  if (!ob || !ISLAZY(ob)) {
+    return ob;
+  }
+  t = &lazytokens[LAZYINDEX(ob)];
+  if (!t->object) {
+    if (PyErr_Occurred()) {	/* Abandoning the parse; see yylex */
+      return Py_None;
+    }
+    tok.type = t->type;
+    tok.text = lazytext + t->text;
+    tok.len = t->len;
+    tok.pre_line = t->pre_line;
+    tok.pre_col = t->pre_col;
+    tok.cur_line = t->cur_line;
+    tok.cur_col = t->cur_col;
+    tok.context = t->context;
+    t->object = scannerapi->maketoken(&tok);
+    if (!t->object) {
+      Py_INCREF(Py_None);
+      t->object = Py_None;
+    }
+    buffersymbol(t->object);
+    BM_STAT(parsestats.materialized++);
+  }
+  return t->object;
+}
+
+#define PYOBJECT(ob) materialize(ob)
+
+/*
+ * Sweeping the buffer.
+ *
+ * The buffer's reference is only needed while a symbol can still be
+ * reached through the parser's value stack: once it has been popped,
+ * it is either a child in the tree, which holds its own reference, or
+ * garbage.  Newlines, parentheses, and everything bison throws away
+ * while recovering from errors are garbage, and left alone they stay
+ * in the buffer until the parse is over.
+ *
+ * So the buffer is swept now and then: every symbol that no slot of
+ * the value stack holds, and that is not the lookahead, the last
+ * token, or the error token or symbol, has its reference dropped.
+ * Stack slots are compared, never followed, so a slot holding a
+ * double or a long in a BISONMODULE_NATIVE grammar at worst keeps
+ * some object a little longer.  A sweep runs once the buffer is twice
+ * the size it was after the last one (and at least BISONMODULE_SWEEP
+ * entries), at a reduction or before reading a token, so it costs a
+ * few comparisons per symbol.  Defining BISONMODULE_SWEEP as 0 turns
+ * it off.
+ *
+ * Only the ob member of each slot is looked at.  A grammar that adds
+ * members with BISONMODULE_VALUES may keep objects in them, where the
+ * sweep would not see them and would free them under the parser, so
+ * sweeping is off by default there; such a grammar may define
+ * BISONMODULE_SWEEP itself only if it keeps Python objects in ob.
+ *
+ * The value stack is a local of yyparse; atreduction() is called from
+ * YYLLOC_DEFAULT, inside yyparse, to find it.  Sweeping thus needs
+ * %locations in the grammar, as profiling does.  The object a lazy
+ * token was made into is kept while the token is on the stack; the
+ * records of tokens that are not still point at freed objects, but
+ * nothing reaches them through a popped token.
+ *
+ * DISCARD, used as a %destructor, drops a lookahead token bison throws
+ * away while recovering from an error as soon as it does so, without
+ * waiting for a sweep; symbols it pops from the stack are left to the
+ * next one.  Bison gives the error token whatever yylval last held,
+ * so DISCARD clears yylval when it drops the token: the $n of error is
+ * then 0, as at the end of the input, rather than a freed object.
+ */
+#ifndef BISONMODULE_SWEEP
+#ifdef BISONMODULE_VALUES
+#define BISONMODULE_SWEEP 0		/* Objects may be in other members */
+#else
+#define BISONMODULE_SWEEP 1024
+#endif
+#endif
+
+#ifdef BISONMODULE_NATIVE
+#define BM_VALUEOB(v) ((v).ob)
+#else
+#define BM_VALUEOB(v) (v)
+#endif
+
+static YYSTYPE **stackbase = NULL;	/* yyparse's yyvs, yyvsp and */
+static YYSTYPE **stacktop = NULL;	/* yyval, while parsing */
+static YYSTYPE *stackval = NULL;
+static Py_ssize_t sweepat = BISONMODULE_SWEEP; /* Sweep at this slot */
+static PyObject **livebuf = NULL;	/* Objects the parser can reach */
+static Py_ssize_t maxlive = 0;
+
+/*
+ * The object a semantic value stands for, or NULL if none has been
+ * made.  The value need not be an object at all.
+ */
+static PyObject *
+liveobject (PyObject * ob)
+{
+  if (ob && ISLAZY(ob)) {
+    Py_intptr_t i = LAZYINDEX(ob);
+    return i >= 0 && i < nlazy ? lazytokens[i].object : NULL;
+  }
+  return ob;
+}
+
+static int
+comparepointers (const void * a, const void * b)
+{
+  Py_uintptr_t x = (Py_uintptr_t) *(PyObject **) a;
+  Py_uintptr_t y = (Py_uintptr_t) *(PyObject **) b;
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * Drop the buffer's references to symbols the parser can no longer
+ * reach.  Those in the tree live on; the rest are freed.
+ */
+static void
+sweepbuffer (void)
+{
+  YYSTYPE *v;
+  PyObject *ob;
+  Py_ssize_t n, nlive = 0, kept = 0, i;
+  if (!stackbase || PyErr_Occurred()) {
+    return;
+  }
+  n = (*stacktop - *stackbase) + 7;
+  if (n > maxlive) {		/* Make room for the live set */
+    PyObject **p = (PyObject **) realloc(livebuf, n * sizeof(PyObject *));
+    if (!p) {
+      return;			/* Keep everything; not an error */
+    }
+    livebuf = p;
+    maxlive = n;
+  }
+				/* The stack, including the slot bison
+				   takes $$ from for an empty rule */
+  for (v = *stackbase; v <= *stacktop + 1; v++) {
+    livebuf[nlive++] = liveobject(BM_VALUEOB(*v));
+  }
+  livebuf[nlive++] = liveobject(BM_VALUEOB(*stackval));
+  livebuf[nlive++] = liveobject(BM_YYLVAL);
+  livebuf[nlive++] = liveobject(lasttoken);
+  livebuf[nlive++] = liveobject(errtoken);
+  livebuf[nlive++] = errsymb;
+  qsort(livebuf, nlive, sizeof(PyObject *), comparepointers);
+  for (i = 0; i < slot; i++) {
+    ob = symbolbuffer[i];
+    symbolbuffer[i] = 0;
+    if (bsearch(&ob, livebuf, nlive, sizeof(PyObject *), comparepointers)) {
+      symbolbuffer[kept++] = ob;
+    } else {
+      Py_DECREF(ob);
+      BM_STAT(parsestats.released++);
+    }
+  }
+  slot = kept;
+  sweepat = 2 * kept > BISONMODULE_SWEEP ? 2 * kept : BISONMODULE_SWEEP;
+}
+
+/*
+ * Sweep the buffer if it has grown enough since the last time.
+ */
+static void
+sweepcheck (void)
+{
+  if (BISONMODULE_SWEEP && slot >= sweepat) {
+    sweepbuffer();
+  }
+}
+
+/*
+ * Called by bison for each reduction, before the rule's action, with
+ * the addresses of its value stack and $$.
+ */
+static void
+atreduction (int rule, YYSTYPE ** base, YYSTYPE ** top, YYSTYPE * val)
+{
+#ifdef BISONMODULE_PROFILE
+  profile_reduce(rule);
+#endif
+  stackbase = base;
+  stacktop = top;
+  stackval = val;
+  sweepcheck();
+}
+
+/*
+ * Replacement for bison's default location computation that also
+ * reports the reduction.  yyn, yyvs, yyvsp, yyval and yyerror_range
+ * belong to yyparse.  A grammar with its own YYLLOC_DEFAULT goes
+ * without sweeping and profiling.
+ */
+#ifndef YYLLOC_DEFAULT
+#define YYLLOC_DEFAULT(Current, Rhs, N)					\
+  do {									\
+    if (&(Rhs)[0] != &yyerror_range[0]) {				\
+      atreduction(yyn, &yyvs, &yyvsp, &yyval);				\
+    }									\
+    if (N) {								\
+      (Current).first_line   = YYRHSLOC(Rhs, 1).first_line;		\
+      (Current).first_column = YYRHSLOC(Rhs, 1).first_column;		\
+      (Current).last_line    = YYRHSLOC(Rhs, N).last_line;		\
+      (Current).last_column  = YYRHSLOC(Rhs, N).last_column;		\
+    } else {								\
+      (Current).first_line   = (Current).last_line   =			\
+	YYRHSLOC(Rhs, 0).last_line;					\
+      (Current).first_column = (Current).last_column =			\
+	YYRHSLOC(Rhs, 0).last_column;					\
+    }									\
+  } while (0)
+#endif
+
+/*
+ * %destructor for symbol objects: { DISCARD($$); } <> (or <ob> in a
+ * BISONMODULE_NATIVE grammar).  Bison passes its lookahead as yylval
+ * itself, which tells it apart from the symbols it pops.  Returns
+ * non-zero if the token was dropped, for DISCARD to clear yylval.
+ */
+static int
+discard (PyObject * ob, int lookahead)
+{
+  PyObject *made = liveobject(ob);
+  if (!lookahead || !made || !slot || PyErr_Occurred()) {
+    return 0;			/* Left for flushbuffer or a sweep */
+  }
+  if (symbolbuffer[slot - 1] != made || ob == errtoken || ob == errsymb) {
+    return 0;
+  }
+  if (ISLAZY(ob)) {
+    lazytokens[LAZYINDEX(ob)].object = NULL;
+  }
+  if (ob == lasttoken) {
+    lasttoken = NULL;
+  }
+  symbolbuffer[--slot] = 0;
+  Py_DECREF(made);
+  BM_STAT(parsestats.released++);
+  return 1;
+}
+
+#define DISCARD(ob)							\
+  do {									\
+    if (discard((ob), &(ob) == &BM_YYLVAL)) {				\
+      (ob) = 0;								\
+    }									\
+  } while (0)
+
+/*
+ * Sharing equal subtrees (hash-consing).
+ *
+ * With share set, parse() keeps a table of the nodes of the parse by
+ * their type, their text if they are tokens and the identities of
+ * their children.  A node handed to REDUCE, APPEND and friends as a
+ * child is looked up there, and an equal node already in the table is
+ * used in its place; otherwise it goes in.  Equal subtrees, and tokens
+ * of the same type and text, then come out as one object, so comparing
+ * them is comparing identities.  Only the first of the equal tokens
+ * keeps its position.
+ *
+ * Nodes go in when they become children, not when they are made,
+ * because REDUCELEFT and REDUCERIGHT add children to the node they are
+ * given (hoc hangs its operands on the operator token).  So once a
+ * node has been made a child, a rule must not add to it: its key would
+ * go stale, and the new children would turn up everywhere it is
+ * shared.  REDUCELEFT and REDUCERIGHT raise ParserError if asked to.
+ * The children of a node in the table are in the table too, or at
+ * least kept alive by the node, so equal addresses are equal children.
+ */
+static PyObject *sharetable = NULL;	/* Nodes by key, or NULL */
+static PyObject *sharedset = NULL;	/* Addresses of the nodes in it */
+static char *sharekey = NULL;		/* Space for building a key */
+static size_t maxsharekey = 0;
+
+typedef struct {
+  long type;			/* Node type */
+  Py_ssize_t nkids;		/* Children, whose addresses follow */
+  Py_ssize_t len;		/* Length of the text that follows them,
+				   or -1 for a symbol */
+} sharekeyhead;
+
+/*
+ * Make the key of a node.  Returns a new reference, or NULL for a node
+ * that can't be shared (with no exception set) or on an error.
+ */
+static PyObject *
+nodekey (PyObject * ob)
+{
+  PyObject *kids = NULL, *string = NULL, *key = NULL;
+  sharekeyhead head;
+  size_t size;
+  Py_ssize_t i;
+  memset(&head, 0, sizeof(head));
+  if (symbolsapi && PyObject_TypeCheck(ob, symbolsapi->symboltype)) {
+    head.type = ((SymbolObject *) ob)->type;
+    kids = ((SymbolObject *) ob)->children;
+    string = ((SymbolObject *) ob)->string;
+    Py_XINCREF(kids);
+    Py_XINCREF(string);
+  } else {			/* Symbols.py, or something like it */
+    PyObject *type;
+    if (ob == Py_None || PyString_Check(ob)) {
+      return NULL;
+    }
+    if (!(type = PyObject_GetAttrString(ob, "type"))) {
+      goto notshared;
+    }
+    head.type = PyInt_AsLong(type);
+    Py_DECREF(type);
+    if ((head.type == -1 && PyErr_Occurred())
+	|| (!(kids = PyObject_GetAttrString(ob, "children"))
+	    && !PyErr_ExceptionMatches(PyExc_AttributeError))) {
+      goto notshared;
+    }
+    PyErr_Clear();
+    if (!(string = PyObject_GetAttrString(ob, "string"))
+	&& !PyErr_ExceptionMatches(PyExc_AttributeError)) {
+      goto notshared;
+    }
+    PyErr_Clear();
+  }
+  if (kids == Py_None) {
+    Py_CLEAR(kids);
+  }
+  if (string == Py_None) {
+    Py_CLEAR(string);
+  }
+  if ((kids && !PyList_Check(kids) && !PyTuple_Check(kids))
+      || (string && !PyString_Check(string))) {
+    goto notshared;
+  }
+  head.nkids = kids ? PySequence_Fast_GET_SIZE(kids) : 0;
+  head.len = string ? PyString_GET_SIZE(string) : -1;
+  size = sizeof(head) + head.nkids * sizeof(PyObject *)
+    + (string ? head.len : 0);
+  if (size > maxsharekey) {	/* Make room for the key */
+    size_t n = maxsharekey ? maxsharekey : 256;
+    char *k;
+    while (size > n) {
+      n *= 2;
+    }
+    if (!(k = realloc(sharekey, n))) {
+      PyErr_NoMemory();
+      goto notshared;
+    }
+    sharekey = k;
+    maxsharekey = n;
+  }
+  memcpy(sharekey, &head, sizeof(head));
+  for (i = 0; i < head.nkids; i++) {
+    memcpy(sharekey + sizeof(head) + i * sizeof(PyObject *),
+	   &PySequence_Fast_ITEMS(kids)[i], sizeof(PyObject *));
+  }
+  if (string) {
+    memcpy(sharekey + sizeof(head) + head.nkids * sizeof(PyObject *),
+	   PyString_AS_STRING(string), head.len);
+  }
+  key = PyString_FromStringAndSize(sharekey, size);
+ notshared:
+  if (PyErr_Occurred() && (PyErr_ExceptionMatches(PyExc_AttributeError)
+			   || PyErr_ExceptionMatches(PyExc_TypeError))) {
+    PyErr_Clear();		/* Not a node; leave it be */
+  }
+  Py_XDECREF(kids);
+  Py_XDECREF(string);
+  return key;
+}
+
+/*
+ * Return the node in the table equal to a node about to become a
+ * child, or the node itself, entering it.  The buffer or the table
+ * owns the result.
+ */
+static PyObject *
+sharenode (PyObject * ob)
+{
+  PyObject *key, *shared;
+  if (!sharetable || !(key = nodekey(ob))) {
+    return ob;
+  }
+  if ((shared = PyDict_GetItem(sharetable, key))) {
+    BM_STAT(parsestats.shared++);
+    ob = shared;
+  } else if (PyDict_SetItem(sharetable, key, ob) == 0) {
+    PyObject *id = PyLong_FromVoidPtr(ob);
+    if (id) {			/* The table keeps ob at this address */
+      PySet_Add(sharedset, id);
+      Py_DECREF(id);
+    }
+  }
+  Py_DECREF(key);
+  return ob;
+}
+
+/*
+ * Raise ParserError and return nonzero if a node is in the table, so
+ * must not be given more children.
+ */
+static int
+sharedfixed (PyObject * ob)
+{
+  PyObject *id;
+  int found;
+  if (!sharedset) {
+    return 0;
+  }
+  if (!(id = PyLong_FromVoidPtr(ob))) {
+    return 1;
+  }
+  found = PySet_Contains(sharedset, id);
+  Py_DECREF(id);
+  if (found > 0) {
+    PyErr_SetString(ParserError,
+		    "a rule added children to a shared node");
+  }
+  return found != 0;
+}
+
+/*
+ * Read a token through the scanner's C interface into a new record.
+ * Returns the token type, or 0 at the end of input or on an error.
+ */
+static int
+lazylex (void)
+{
+  ScannedToken tok;
+  lazytoken *t;
+  if (scannerapi->next(&tok) <= 0) {
+    return 0;
+  }
+  if (nlazy >= maxlazy) {	/* Make room for the record */
+    long n = maxlazy ? maxlazy * 2 : 1024;
+    lazytoken *recs = realloc(lazytokens, n * sizeof(lazytoken));
+    if (!recs) {
+      PyErr_NoMemory();
+      return 0;
+    }
+    lazytokens = recs;
+    maxlazy = n;
+  }
+  if (lazytextlen + tok.len > maxlazytext) { /* and for the text */
+    Py_ssize_t n = maxlazytext ? maxlazytext : 1 << 14;
+    char *text;
+    while (lazytextlen + tok.len > n) {
+      n *= 2;
+    }
+    if (!(text = realloc(lazytext, n))) {
+      PyErr_NoMemory();
+      return 0;
+    }
+    lazytext = text;
+    maxlazytext = n;
+  }
+  t = &lazytokens[nlazy];
+  t->type = tok.type;
+  t->text = lazytextlen;
+  t->len = tok.len;
+  memcpy(lazytext + lazytextlen, tok.text, tok.len);
+  lazytextlen += tok.len;
+  t->pre_line = tok.pre_line;
+  t->pre_col = tok.pre_col;
+  t->cur_line = tok.cur_line;
+  t->cur_col = tok.cur_col;
+  Py_INCREF(tok.context);
+  t->context = tok.context;
+  t->object = NULL;
+  BM_YYLVAL = LAZYTOKEN(nlazy);
+  nlazy++;
+  return tok.type;
+}
+
+/*
+ * Forget the token records of a parse.  Any objects made from them
+ * belong to the buffer or the tree.
+ */
+static void
+flushlazy (void)
+{
+  long i;
+  for (i = 0; i < nlazy; i++) {
+    Py_DECREF(lazytokens[i].context);
+  }
+  nlazy = 0;
+  lazytextlen = 0;
+}
+
+/*
+ * Free the symbol buffer and token records, which are otherwise kept
+ * for the next parse.  Called after flushing them, when an input ran
+ * into a limit (and may have made them very large) and by release().
+ */
+static void
+releasebuffers (void)
+{
+  free(symbolbuffer);
+  symbolbuffer = NULL;
+  maxslot = 1;
+  slot = 0;
+  free(lazytokens);
+  lazytokens = NULL;
+  maxlazy = 0;
+  free(lazytext);
+  lazytext = NULL;
+  maxlazytext = 0;
+  free(tokenbuf);
+  tokenbuf = NULL;
+  maxtokenbuf = 0;
+  free(livebuf);
+  livebuf = NULL;
+  maxlive = 0;
+}
+
 /*
  * Clear the existing parse tree reference and create a new one
  */
 static void
 setparsetree (PyObject * symbol)
 {
+  symbol = materialize(symbol);
   Py_XDECREF (parsetree);
   parsetree = symbol;
   Py_INCREF (parsetree);
 }
 
+/*
+ * Call makesymbol with a type and a list of children, timing the call
+ * if asked to, and counting it against the deadline.
+ */
+static PyObject *
+callmakesymbol (int symboltype, PyObject * list)
+{
+  if (pastdeadline()) {
+    return NULL;
+  }
+#ifdef BISONMODULE_STATS
+  if (parsestats.timing) {
+    double start = stats_clock();
+    PyObject *ob = symbolsapi
+      ? symbolsapi->makesymbol(makesymbol, symboltype, list)
+      : PyObject_CallFunction(makesymbol, "iO", symboltype, list);
+    parsestats.makesymbol_time += stats_clock() - start;
+    return ob;
+  }
+#endif
+  if (symbolsapi) {		/* cSymbols makes its own directly */
+    return symbolsapi->makesymbol(makesymbol, symboltype, list);
+  }
+  return PyObject_CallFunction(makesymbol, "iO", symboltype, list);
+}
+
 /*
  * Create a new symbol and insert it into the buffer
  *
@@ -210,6 +1054,9 @@ reduce (int symboltype, ...)
 {
   va_list args;
   PyObject *list, *ob;
+  if (PyErr_Occurred()) {	/* Abandoning the parse; see yylex */
+    return Py_None;
+  }
   list = PyList_New (0);	/* Create the list of children */
   if (!list) {
     Py_INCREF(Py_None);
@@ -217,11 +1064,16 @@ reduce (int symboltype, ...)
   }
   va_start(args, symboltype);	/* Put the children in the list */
   for (ob = va_arg (args, PyObject *); ob; ob = va_arg (args, PyObject *)) {
-    PyList_Append(list, ob);
+    if (countnode()) {
+      break;
+    }
+    PyList_Append(list, sharenode(materialize(ob)));
   }
   va_end(args);
-				/* Call makesymbol */
-  ob = PyObject_CallFunction(makesymbol, "iO", symboltype, list);
+  BM_STAT(parsestats.reduce++);
+				/* Call makesymbol, unless abandoning
+				   the parse */
+  ob = PyErr_Occurred() ? NULL : callmakesymbol(symboltype, list);
   Py_DECREF (list);		/* Free the list */
   if (!ob) {
     Py_INCREF(Py_None);
@@ -245,10 +1097,29 @@ reduceleft (PyObject * listsymbol, ...)
 {
   va_list args;
   PyObject *ob;
+  if (PyErr_Occurred()) {	/* Abandoning the parse; see yylex */
+    return listsymbol;
+  }
   va_start(args, listsymbol);
+  BM_STAT(parsestats.reduceleft++);
+  listsymbol = materialize(listsymbol);
+  if (sharedfixed(listsymbol)) {
+    va_end(args);
+    return listsymbol;
+  }
 				/* Append each argument to the list */
   for (ob = va_arg(args, PyObject *); ob; ob = va_arg(args, PyObject *)) {
-    PyObject_CallMethod(listsymbol, "append", "O", ob);
+    if (countnode()) {
+      break;
+    }
+    ob = sharenode(materialize(ob));
+    if (PyErr_Occurred()) {
+      break;
+    }
+    if (!symbolsapi || !symbolsapi->append(listsymbol, ob)) {
+      PyObject *res = PyObject_CallMethod(listsymbol, "append", "O", ob);
+      Py_XDECREF(res);
+    }
   }
   va_end(args);
   return listsymbol;
@@ -265,35 +1136,162 @@ reduceright (PyObject * listsymbol, ...)
 {
   va_list args;
   PyObject *ob;
+  if (PyErr_Occurred()) {	/* Abandoning the parse; see yylex */
+    return listsymbol;
+  }
   va_start(args, listsymbol);
+  BM_STAT(parsestats.reduceright++);
+  listsymbol = materialize(listsymbol);
+  if (sharedfixed(listsymbol)) {
+    va_end(args);
+    return listsymbol;
+  }
 				/* Prepend each argument to the list */
   for (ob = va_arg(args, PyObject *); ob; ob = va_arg(args, PyObject *)) {
-    PyObject_CallMethod(listsymbol, "insert", "iO", 0, ob);
+    if (countnode()) {
+      break;
+    }
+    ob = sharenode(materialize(ob));
+    if (PyErr_Occurred()) {
+      break;
+    }
+    if (!symbolsapi || !symbolsapi->insert(listsymbol, 0, ob)) {
+      PyObject *res = PyObject_CallMethod(listsymbol, "insert", "iO", 0, ob);
+      Py_XDECREF(res);
+    }
   }
   va_end(args);
   return listsymbol;
 }
 
 /*
- * Function needed by Bison-generated parser.  Defining
- * YYERROR_VERBOSE sometimes makes the string interesting, if not
- * necessarily useful.
+ * Syntax errors.
+ *
+ * Some inputs are mostly errors, so reporting one has to be cheap.
+ * The message bison hands yyerror is copied into a preallocated buffer
+ * (truncated if need be) rather than a fresh malloc, and the string
+ * object given to makesymbol is kept and reused while the message
+ * text stays the same, which it nearly always does.
+ *
+ * Each error is also recorded as a small C structure: the type of the
+ * offending token, its offset in the token stream, and the parser
+ * state, from which the set of expected tokens can be worked out.
+ * The Python form of these records is only built if errors() is
+ * called.  Setting max_errors in parse() aborts the parse with
+ * ParserError once that many errors have been seen.
+ */
+#ifndef BISONMODULE_ERRMSGSIZE
+#define BISONMODULE_ERRMSGSIZE 256
+#endif
+
+typedef struct {
+  int type;			/* Token type at the error */
+  long offset;			/* Index of that token in the input */
+  int state;			/* Parser state, for expected tokens,
+				   or -1 from bisonmodule_error */
+} errorrecord;
+
+static char errbuf[BISONMODULE_ERRMSGSIZE]; /* Pool for errmsg */
+static PyObject *errmsgobj = NULL;	/* Python copy of last message */
+static errorrecord *errorrecs = NULL;	/* Errors in the current parse */
+static int maxerrorrecs = 0;		/* Current size of errorrecs */
+static int nerrors = 0;			/* Errors in the current parse */
+static int maxerrors = 0;		/* Abort after this many; 0 never */
+static int lasttype = 0;		/* Type of last token read */
+static long ntokens = 0;		/* Tokens read in this parse */
+
+				/* Expected tokens in a state; set
+				   by BISONMODULEINIT, which can see
+				   bison's tables */
+static PyObject *(*expectedtokens) (int state) = NULL;
+
+/*
+ * Copy an error message into the buffer
  */
 static void
-yyerror (char *s)
+seterrmsg (const char *s)
 {
-  if (errmsg) { free(errmsg); }	/* Free an existing error message */
-				/* and copy the new one */
-  errmsg = malloc(strlen(s) + 1);
-  if (!errmsg) {
-    PyErr_NoMemory();
-  } else {
-    strcpy(errmsg, s);
-  }
+  strncpy(errbuf, s, BISONMODULE_ERRMSGSIZE - 1);
+  errbuf[BISONMODULE_ERRMSGSIZE - 1] = 0;
+  errmsg = errbuf;
   errtoken = lasttoken;		/* Save a copy of the last token */
 }
+
+/*
+ * Record a syntax error reported by bison in the given state.  Bison
+ * also reports running out of stack through yyerror; full is non-zero
+ * then, and nothing is recorded.  Returns non-zero if the parse should
+ * be abandoned.
+ */
+static int
+syntaxerror (const char *s, int state, int full)
+{
+  if (full) {
+    return 0;			/* The stack is full; see c_parse */
+  }
+  if (PyErr_Occurred()) {	/* Abandoning the parse; see yylex */
+    return 1;
+  }
+  seterrmsg(s);
+  BM_STAT(parsestats.errors++);
+  if (nerrors >= maxerrorrecs) { /* Make room for the record */
+    int n = maxerrorrecs ? maxerrorrecs * 2 : 64;
+    errorrecord *recs = realloc(errorrecs, n * sizeof(errorrecord));
+    if (!recs) {
+      PyErr_NoMemory();
+      return 1;
+    }
+    errorrecs = recs;
+    maxerrorrecs = n;
+  }
+  errorrecs[nerrors].type = lasttype;
+  errorrecs[nerrors].offset = ntokens - 1;
+  errorrecs[nerrors].state = state;
+  nerrors++;
+  if (maxerrors && nerrors >= maxerrors) {
+    PyErr_Format(ParserError, "too many syntax errors (%d)", nerrors);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Function needed by Bison-generated parser.  Defining
+ * YYERROR_VERBOSE sometimes makes the string interesting, if not
+ * necessarily useful.
+ *
+ * This is a macro so that it can see bison's state stack and abort
+ * the parse; it can only be used inside yyparse, including rule
+ * actions.  Code elsewhere in a grammar file, such as helpers in its
+ * prologue or epilogue, calls bisonmodule_error instead.  The stack
+ * is full, rather than the input wrong, if stackalloc
+ * failed or the state stack has reached YYMAXDEPTH (bison grows it
+ * before it looks at the next token, so a syntax error never finds it
+ * full); bison's message is not looked at, since it may be translated.
+ */
+#define yyerror(s)							\
+  do {									\
+    if (syntaxerror((s), *yyssp,					\
+		    stackfailed || yyss + yystacksize - 1 <= yyssp)) {	\
+      YYABORT;								\
+    }									\
+  } while (0)
 #define YYERROR_VERBOSE 1
 
+/*
+ * Report a syntax error from outside yyparse, as yyerror did when it
+ * was a function.  The error is recorded and REDUCEERROR picks up the
+ * message, but there is no parser state, so errors() lists no expected
+ * tokens for it.  Reaching max_errors sets the exception, and the
+ * parse is abandoned when yylex next sees it.  Not static, like
+ * yyparse, so that a grammar need not use it.
+ */
+void
+bisonmodule_error (const char *s)
+{
+  syntaxerror(s, -1, 0);
+}
+
 /*
  * For error rules, create a syntax error token
  * 
@@ -312,22 +1310,40 @@ yyerror (char *s)
 static PyObject *
 reduceerror (void)
 {
+  PyObject *list;
+  if (PyErr_Occurred()) {	/* Abandoning the parse; see yylex */
+    return Py_None;
+  }
   if (!errmsg && errsymb) {
     return errsymb;		/* Re-use previous error */
   } else if (!errmsg) {
-    yyerror("parser error: reducing error with no message");
+    seterrmsg("parser error: reducing error with no message");
   }
   if (!errtoken) {
     errtoken = lasttoken;
   }
+  BM_STAT(parsestats.recoveries++);
+				/* Reuse the message object if the
+				   text has not changed */
+  if (!errmsgobj || strcmp(PyString_AS_STRING(errmsgobj), errmsg)) {
+    Py_XDECREF(errmsgobj);
+    errmsgobj = PyString_FromString(errmsg);
+  }
+  errmsg = NULL;
 				/* Call makesymbol for a syntax error
 				   symbol with the last token seen
 				   before the error and the error
 				   message that was reported. */
-  errsymb = PyObject_CallFunction (makesymbol, "i[Os]", 
-				   SYNTAXERROR, errtoken, errmsg);
-  free(errmsg);			/* Clean up and return the syntax error */
-  errmsg = NULL;
+  errsymb = NULL;
+  if (errmsgobj && (list = PyList_New(2))) {
+    PyObject *near = errtoken ? materialize(errtoken) : Py_None;
+    Py_INCREF(near);
+    PyList_SET_ITEM(list, 0, near);
+    Py_INCREF(errmsgobj);
+    PyList_SET_ITEM(list, 1, errmsgobj);
+    errsymb = callmakesymbol(SYNTAXERROR, list);
+    Py_DECREF(list);
+  }
   if (!errsymb) {
     Py_INCREF (Py_None);
     errsymb = Py_None;
@@ -352,6 +1368,110 @@ reduceerror (void)
 #define REDUCEERROR reduceerror()
 #define RETURNTREE(symbol) setparsetree(symbol)
 
+#ifdef BISONMODULE_NATIVE
+/*
+ * Native values (see BISONMODULE_NATIVE above).
+ *
+ * BOX makes an object of a new reference for REDUCE and friends or
+ * RETURNTREE, handing it to the buffer; a NULL (with an exception set)
+ * becomes None and abandons the parse.  BOXDOUBLE and BOXLONG box the
+ * usual scalars.  TOKENTEXT gives the text of a token, lazy or not,
+ * without making an object of it; TOKENDOUBLE and TOKENLONG convert
+ * it, so that a rule like
+ *
+ *	expr: NUMBER	{ $$ = TOKENDOUBLE($1); }
+ *
+ * costs no allocation at all when reading from a scannerapi.
+ */
+static PyObject *
+box (PyObject * ob)
+{
+  if (!ob) {
+    Py_INCREF(Py_None);
+    ob = Py_None;
+  }
+  buffersymbol(ob);
+  return ob;
+}
+
+/*
+ * Return the text of a token, good until the next call.  On an error,
+ * the text is empty and the exception abandons the parse.
+ */
+static const char *
+tokentext (PyObject * ob)
+{
+  PyObject *string = NULL;
+  const char *text = "";
+  Py_ssize_t len = 0;
+  if (ob && ISLAZY(ob)) {
+    lazytoken *t = &lazytokens[LAZYINDEX(ob)];
+    text = lazytext + t->text;
+    len = t->len;
+  } else if (ob && ob != Py_None) {
+    if (symbolsapi && PyObject_TypeCheck(ob, symbolsapi->symboltype)) {
+      string = ((SymbolObject *) ob)->string;
+      Py_XINCREF(string);
+    } else {
+      string = PyObject_GetAttrString(ob, "string");
+    }
+    if (string && PyString_Check(string)) {
+      text = PyString_AS_STRING(string);
+      len = PyString_GET_SIZE(string);
+    } else if (string || !PyErr_Occurred()) {
+      PyErr_SetString(PyExc_TypeError, "token text must be a string");
+    }
+  }
+  if (len >= maxtokenbuf) {	/* Copy it, adding a NUL */
+    Py_ssize_t n = maxtokenbuf ? maxtokenbuf : 64;
+    char *buf;
+    while (len >= n) {
+      n *= 2;
+    }
+    if (!(buf = realloc(tokenbuf, n))) {
+      Py_XDECREF(string);
+      PyErr_NoMemory();
+      return "";
+    }
+    tokenbuf = buf;
+    maxtokenbuf = n;
+  }
+  memcpy(tokenbuf, text, len);
+  tokenbuf[len] = 0;
+  Py_XDECREF(string);
+  return tokenbuf;
+}
+
+#define BOX(ob) box(ob)
+#define BOXDOUBLE(d) box(PyFloat_FromDouble(d))
+#define BOXLONG(l) box(PyInt_FromLong(l))
+#define TOKENTEXT(ob) tokentext(ob)
+#define TOKENDOUBLE(ob) strtod(tokentext(ob), NULL)
+#define TOKENLONG(ob) strtol(tokentext(ob), NULL, 0)
+#endif
+
+/*
+ * Abandoning a parse.
+ *
+ * Once an exception is pending (a limit, a failed readtoken or
+ * makesymbol), yylex stops reading.  The first time, it gives bison
+ * ABORTTOKEN, which no rule can use; bison reports a syntax error and
+ * yyerror, seeing the exception, aborts.  If bison was recovering from
+ * an earlier error, it throws the token away instead and asks for
+ * another, and the end of the input makes it give up.  Actions bison
+ * still runs on the way (default reductions) leave the tree alone:
+ * REDUCE and friends do nothing while an exception is pending.
+ */
+#define ABORTTOKEN INT_MAX
+static int abandoned = 0;		/* ABORTTOKEN already returned */
+
+static int
+abandon (void)
+{
+  BM_YYLVAL = 0;
+  return abandoned++ ? 0 : ABORTTOKEN;
+}
+
 /*
  * Buffer and return the next token from the scanner
  * 
@@ -362,23 +1482,48 @@ yylex (void)
 {
   PyObject *pair, *type, *token;
   int typevalue;
-				/* readtoken() and pick out the type
-                                   and token */
-  pair = PyObject_CallFunction(readtoken, NULL);
-  if (!pair || pair == Py_None || 
-      !(type = PySequence_GetItem(pair, 0)) ||
-      !(token = PySequence_GetItem(pair, 1))) {
-    Py_XDECREF(pair);		/* XDECREF safe from nulls */
-    yylval = 0;
-    return 0;
+#ifdef BISONMODULE_PROFILE
+  profile_stop();		/* The last action is over */
+#endif
+  if (PyErr_Occurred()) {
+    return abandon();
   }
-  Py_DECREF(pair);
-  buffersymbol(token);		/* Insert into buffer */
-  lasttoken = token;		/* Save the last token in case of errors */
-  yylval = token;		/* Return the token as a rule's $n */
+  sweepcheck();			/* A safe point: nothing half made */
+  if (scannerapi) {		/* Read a lazy token */
+    if (!(typevalue = lazylex())) {
+      BM_YYLVAL = 0;
+      return PyErr_Occurred() ? abandon() : 0;
+    }
+    BM_STAT(parsestats.tokens++);
+    lasttoken = BM_YYLVAL;
+  } else {
+				/* readtoken() and pick out the type
+				   and token */
+    pair = PyObject_CallFunction(readtoken, NULL);
+    if (!pair || pair == Py_None || 
+	!(type = PySequence_GetItem(pair, 0)) ||
+	!(token = PySequence_GetItem(pair, 1))) {
+      Py_XDECREF(pair);		/* XDECREF safe from nulls */
+      BM_YYLVAL = 0;
+      return PyErr_Occurred() ? abandon() : 0;
+    }
+    Py_DECREF(pair);
+    buffersymbol(token);	/* Insert into buffer */
+    BM_STAT(parsestats.tokens++);
+    lasttoken = token;		/* Save the last token in case of errors */
+    BM_YYLVAL = token;	/* Return the token as a rule's $n */
 				/* return token type */
-  typevalue = (int) PyInt_AsLong(type);
-  Py_DECREF(type);
+    typevalue = (int) PyInt_AsLong(type);
+    Py_DECREF(type);
+  }
+  lasttype = typevalue;
+  ntokens++;
+  if (maxtokens && ntokens > maxtokens) {
+    PyErr_Format(LimitExceeded, "token limit exceeded (%ld)", maxtokens);
+  }
+  if (PyErr_Occurred() || pastdeadline()) {
+    return abandon();
+  }
   return typevalue;
 }
 
@@ -392,30 +1537,138 @@ yylex (void)
  * the parse tree top node.
  */
 static PyObject *
-c_parse (PyObject * self, PyObject * args)
+c_parse (PyObject * self, PyObject * args, PyObject * kwds)
 {
+  static char *kwlist[] = {"makesymbol", "readtoken", "max_errors",
+			   "max_depth", "deadline", "max_tokens",
+			   "max_nodes", "share", NULL};
+  int max_errors = 0;
+  long max_depth = BISONMODULE_MAXDEPTH;
+  double deadline = 0;
+  long max_tokens = 0, max_nodes = 0;
+  int share = 0;
 				/* Initialize scanner */
   Py_XDECREF(makesymbol); makesymbol = NULL;
   Py_XDECREF(readtoken); readtoken = NULL;
-  if (!PyArg_ParseTuple(args, "OO", &makesymbol, &readtoken)) { return NULL; }
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|ildlli", kwlist,
+				   &makesymbol, &readtoken, &max_errors,
+				   &max_depth, &deadline, &max_tokens,
+				   &max_nodes, &share)) {
+    return NULL;
+  }
+  if (max_depth < 1) {
+    makesymbol = readtoken = NULL;
+    PyErr_SetString(PyExc_ValueError, "max_depth must be positive");
+    return NULL;
+  }
+  if (deadline < 0 || max_tokens < 0 || max_nodes < 0) {
+    makesymbol = readtoken = NULL;
+    PyErr_SetString(PyExc_ValueError, "limits must not be negative");
+    return NULL;
+  }
+  if (share && (!(sharetable = PyDict_New())
+		|| !(sharedset = PySet_New(NULL)))) {
+    Py_CLEAR(sharetable);
+    makesymbol = readtoken = NULL;
+    return NULL;
+  }
   Py_INCREF(makesymbol);
   Py_INCREF(readtoken);
+  scannerapi = NULL;		/* A scanner's C interface? */
+  if (PyCapsule_IsValid(readtoken, SCANNERAPI_CAPSULE)) {
+    scannerapi = (ScannerAPI *) PyCapsule_GetPointer(readtoken,
+						     SCANNERAPI_CAPSULE);
+  }
   Py_INCREF(Py_None);		/* Initialize returned parsetree */
   parsetree = Py_None;
+  lasttoken = errtoken = errsymb = NULL; /* Forget the last parse */
+  errmsg = NULL;
+  nerrors = 0;
+  maxerrors = max_errors;
+  maxdepth = max_depth;
+  stackfailed = 0;
+  stoptime = deadline;
+  maxtokens = max_tokens;
+  maxnodes = max_nodes;
+  nnodes = 0;
+  nclock = BISONMODULE_CLOCKEVERY - 1; /* Look at the clock at once */
+  abandoned = 0;
+  lasttype = 0;
+  ntokens = 0;
   clearbuffer();		/* Set up the parsing buffer */
-  if (yyparse()) {		/* Call parser */
+  sweepat = BISONMODULE_SWEEP;
+  parsing = 1;
+  switch (yyparse()) {		/* Call parser */
+  case 0:
+    break;
+  case 2:			/* Out of stack */
+    if (!PyErr_Occurred ()) {
+      PyErr_Format(ParserError, "parser stack exceeded max_depth (%ld)",
+		   maxdepth);
+    }
+    break;
+  default:
     if (!PyErr_Occurred ()) {
       PyErr_SetString(ParserError, "syntax error");
     }
   }
-  if (errmsg) { free(errmsg); }	/* Free remaining error message */
+#ifdef BISONMODULE_PROFILE
+  profile_stop();
+#endif
+  stackbase = stacktop = NULL;	/* yyparse has returned */
+  stackval = NULL;
+  errmsg = NULL;		/* Forget any unused error message */
   flushbuffer();		/* Release unneeded symbols */
+  flushlazy();
+  Py_CLEAR(sharetable);		/* The tree holds what it needs */
+  Py_CLEAR(sharedset);
+  lasttoken = errtoken = errsymb = NULL; /* These were in the buffer */
+  parsing = 0;
   if (PyErr_Occurred()) {
+    if (PyErr_ExceptionMatches(LimitExceeded)) {
+      releasebuffers();
+      if (scannerapi) {		/* Its positions, files and lookahead */
+	scannerapi->close();
+      }
+    }
     return NULL;
   }
   return parsetree;		/* Return the top of the parse tree */
 }
 
+/*
+ * Return the syntax errors of the last parse as a list of tuples of
+ * the offending token's type, its index in the token stream, and a
+ * list of the token types that would have been acceptable.
+ */
+static PyObject *
+c_errors (PyObject * self, PyObject * args)
+{
+  PyObject *list, *expected, *rec;
+  int i;
+  if (!PyArg_ParseTuple(args, "")) {
+    return NULL;
+  }
+  if (!(list = PyList_New(nerrors))) {
+    return NULL;
+  }
+  for (i = 0; i < nerrors; i++) {
+    if (expectedtokens && errorrecs[i].state >= 0) {
+      expected = expectedtokens(errorrecs[i].state);
+    } else {
+      expected = PyList_New(0);
+    }
+    rec = expected ? Py_BuildValue("(i,l,N)", errorrecs[i].type,
+				   errorrecs[i].offset, expected) : NULL;
+    if (!rec) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, i, rec);
+  }
+  return list;
+}
+
 /*
  * Toggle Bison's debug flag
  */
@@ -430,20 +1683,204 @@ c_debug (PyObject * self, PyObject * args)
   return Py_None;
 }
 
+/*
+ * Free the symbol buffer and token records kept between parses
+ */
+static PyObject *
+c_release (PyObject * self, PyObject * args)
+{
+  if (!PyArg_ParseTuple(args, "")) {
+    return NULL;
+  }
+  if (parsing) {
+    PyErr_SetString(PyExc_ValueError, "Parsing");
+    return NULL;
+  }
+  releasebuffers();
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+#ifdef BISONMODULE_STATS
+/*
+ * Insert a value into a statistics dictionary, taking over the
+ * reference.
+ */
+static void
+stats_item (PyObject * dict, char * name, PyObject * value)
+{
+  if (value) {
+    PyMapping_SetItemString(dict, name, value);
+    Py_DECREF(value);
+  }
+}
+#endif
+
+/*
+ * Return the statistics gathered so far
+ */
+static PyObject *
+c_stats (PyObject * self, PyObject * args)
+{
+  PyObject *dict;
+  if (!PyArg_ParseTuple(args, "")) {
+    return NULL;
+  }
+  if (!(dict = PyDict_New())) {
+    return NULL;
+  }
+#ifdef BISONMODULE_STATS
+  stats_item(dict, "tokens", PyInt_FromLong(parsestats.tokens));
+  stats_item(dict, "reduce", PyInt_FromLong(parsestats.reduce));
+  stats_item(dict, "reduceleft", PyInt_FromLong(parsestats.reduceleft));
+  stats_item(dict, "reduceright", PyInt_FromLong(parsestats.reduceright));
+  stats_item(dict, "errors", PyInt_FromLong(parsestats.errors));
+  stats_item(dict, "recoveries", PyInt_FromLong(parsestats.recoveries));
+  stats_item(dict, "materialized", PyInt_FromLong(parsestats.materialized));
+  stats_item(dict, "shared", PyInt_FromLong(parsestats.shared));
+  stats_item(dict, "released", PyInt_FromLong(parsestats.released));
+  stats_item(dict, "buffer_highwater", PyInt_FromSsize_t(parsestats.highwater));
+  if (parsestats.timing) {
+    stats_item(dict, "makesymbol_time",
+	       PyFloat_FromDouble(parsestats.makesymbol_time));
+  }
+#endif
+  if (PyErr_Occurred()) {
+    Py_DECREF(dict);
+    return NULL;
+  }
+  return dict;
+}
+
+/*
+ * Clear the statistics; an optional argument turns makesymbol timing
+ * on (non-zero) or off (zero)
+ */
+static PyObject *
+c_reset_stats (PyObject * self, PyObject * args)
+{
+  int timing = parsestats.timing;
+  if (!PyArg_ParseTuple(args, "|i", &timing)) {
+    return NULL;
+  }
+  memset(&parsestats, 0, sizeof(parsestats));
+  parsestats.timing = timing;
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+/*
+ * Return the rule profile: a dictionary mapping (file, line) of each
+ * grammar rule to (lhs name, reductions, seconds).
+ */
+static PyObject *
+c_profile (PyObject * self, PyObject * args)
+{
+  PyObject *dict;
+  if (!PyArg_ParseTuple(args, "")) {
+    return NULL;
+  }
+  if (!(dict = PyDict_New())) {
+    return NULL;
+  }
+#ifdef BISONMODULE_PROFILE
+  {
+    int r;
+    for (r = 1; r < ruleprofile.nrules; r++) {
+      PyObject *rule = PyTuple_GET_ITEM(ruleprofile.rules, r);
+      PyObject *key, *value, *old;
+      long count = ruleprofile.reductions[r];
+      double seconds = ruleprofile.seconds[r];
+      if (!rule) {
+	continue;
+      }
+      key = PyTuple_GetSlice(rule, 0, 2);
+      if (!key) {
+	break;
+      }
+				/* Rules sharing a line share an entry */
+      if ((old = PyDict_GetItem(dict, key))) {
+	count += PyInt_AsLong(PyTuple_GET_ITEM(old, 1));
+	seconds += PyFloat_AsDouble(PyTuple_GET_ITEM(old, 2));
+      }
+      value = Py_BuildValue("(O,l,d)", PyTuple_GET_ITEM(rule, 2),
+			    count, seconds);
+      if (value) {
+	PyDict_SetItem(dict, key, value);
+      }
+      Py_DECREF(key);
+      Py_XDECREF(value);
+    }
+  }
+#endif
+  if (PyErr_Occurred()) {
+    Py_DECREF(dict);
+    return NULL;
+  }
+  return dict;
+}
+
+/*
+ * Clear the rule profile
+ */
+static PyObject *
+c_reset_profile (PyObject * self, PyObject * args)
+{
+  if (!PyArg_ParseTuple(args, "")) {
+    return NULL;
+  }
+  if (ruleprofile.nrules) {
+    memset(ruleprofile.reductions, 0, ruleprofile.nrules * sizeof(long));
+    memset(ruleprofile.seconds, 0, ruleprofile.nrules * sizeof(double));
+  }
+  ruleprofile.current = 0;
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
 /*
  * Function table for the module
  */
 static PyMethodDef module_methods[] = {
-  {"parse", c_parse, METH_VARARGS, 
-   "parse(makesymbol, readtoken) : parse tokens from an input stream\n"
+  {"parse", (PyCFunction) c_parse, METH_VARARGS | METH_KEYWORDS,
+   "parse(makesymbol, readtoken[, max_errors, max_depth, deadline,\n"
+   "      max_tokens, max_nodes, share]) :\n"
+   "    parse tokens from an input stream\n"
    " - makesymbol should have the arguments\n"
    "   + a numeric symbol type\n"
    "   + a list of children\n"
    " - readtoken returns the next token's type and a Python object\n"
    "   which should have append (for REDUCELEFT) and insert (for\n"
-   "   REDUCERIGHT) methods"},
+   "   REDUCERIGHT) methods; or it is a FlexModule scanner's\n"
+   "   scannerapi, and tokens are only made when rules keep them\n"
+   " - max_errors, if non-zero, raises ParserError after that many\n"
+   "   syntax errors\n"
+   " - max_depth limits the parser stack, which grows as needed;\n"
+   "   ParserError is raised if it is exceeded\n"
+   " - deadline (a time.time() value), max_tokens and max_nodes (of\n"
+   "   the tree), if non-zero, abandon the parse with LimitExceeded,\n"
+   "   a ParserError, once one is passed\n"
+   " - share, if true, makes equal subtrees and tokens of the same\n"
+   "   type and text one object, as they become children"},
+  {"errors", c_errors, METH_VARARGS,
+   "errors() : return the syntax errors of the last parse as a list of\n"
+   "           (token type, token index, [expected token types])"},
   {"debug", c_debug, METH_VARARGS, 
    "debug() : toggle trace from parser to stderr"},
+  {"release", c_release, METH_VARARGS,
+   "release() : free the buffers kept between parses"},
+  {"stats", c_stats, METH_VARARGS,
+   "stats() : return a dictionary of counters gathered since the last\n"
+   "          reset_stats(); empty unless built with BISONMODULE_STATS"},
+  {"reset_stats", c_reset_stats, METH_VARARGS,
+   "reset_stats([timing]) : clear the counters; a true timing argument\n"
+   "                        also times calls to makesymbol"},
+  {"profile", c_profile, METH_VARARGS,
+   "profile() : return {(file, line): (lhs, reductions, seconds)} for\n"
+   "            each grammar rule; empty unless built with\n"
+   "            BISONMODULE_PROFILE"},
+  {"reset_profile", c_reset_profile, METH_VARARGS,
+   "reset_profile() : clear the rule profile"},
   {NULL, NULL, 0, 0}
 };
 
@@ -493,33 +1930,90 @@ makesymboldicts (SymbolValues * symbs, PyObject * moddict)
 }
 
 /*
- * Set up the syntax error exception
+ * Set up the syntax error exception, and LimitExceeded under it
  */
 static void
 makesyntaxerror (char * modname, PyObject * moddict)
 {
   int mlen = strlen(modname);
-  char *buf = malloc(mlen + 13);
+  char *buf = malloc(mlen + 15);
   strcpy(buf, modname);
   strcpy(buf + mlen, ".ParserError");
   ParserError = PyErr_NewException(buf, NULL, NULL);
   PyDict_SetItemString(moddict, "ParserError", ParserError);
+  strcpy(buf + mlen, ".LimitExceeded");
+  LimitExceeded = PyErr_NewException(buf, ParserError, NULL);
+  PyDict_SetItemString(moddict, "LimitExceeded", LimitExceeded);
   free(buf);
 }
 
+/*
+ * Set up the rule profile from bison's tables.  BISONMODULEINIT
+ * appears in the grammar file's epilogue, so __FILE__ names the
+ * grammar itself (bison emits a #line for it).
+ */
+#ifdef BISONMODULE_PROFILE
+#define BISONMODULEPROFILE						    \
+  do {								    \
+    int r;							    \
+    profile_init(YYNRULES + 1);					    \
+    for (r = 1; r <= YYNRULES && ruleprofile.nrules; r++) {	    \
+      profile_rule(r, __FILE__, yyrline[r], yytname[yyr1[r]]);	    \
+    }								    \
+  } while (0)
+#else
+#define BISONMODULEPROFILE
+#endif
+
+/*
+ * Work out the tokens acceptable in a parser state, as bison does for
+ * its verbose error messages, and map them back to the token types
+ * returned by readtoken.  This is expanded by BISONMODULEINIT, after
+ * bison's tables; symbol number 1 is bison's error token.
+ */
+#define BISONMODULETABLES						    \
+static PyObject *							    \
+expected_tokens (int state)						    \
+{									    \
+  PyObject *list = PyList_New(0);					    \
+  int yyn = yypact[state], ext;					    \
+  if (!list || yypact_value_is_default(yyn)) {			    \
+    return list;							    \
+  }									    \
+  for (ext = 0; ext <= YYMAXUTOK; ext++) {				    \
+    int yyx = yytranslate[ext];						    \
+    if (yyx + yyn >= 0 && yyx + yyn <= YYLAST && yyx != 1 &&		    \
+	yycheck[yyx + yyn] == yyx &&					    \
+	!yytable_value_is_error(yytable[yyx + yyn])) {		    \
+      PyObject *t = PyInt_FromLong(ext);				    \
+      if (!t || PyList_Append(list, t) < 0) {				    \
+	Py_XDECREF(t);							    \
+	Py_DECREF(list);						    \
+	return NULL;							    \
+      }									    \
+      Py_DECREF(t);							    \
+    }									    \
+  }									    \
+  return list;								    \
+}
+
 /*
  * Initialize the module based on the module name and the symbol
  * mapping.
  */
 #define BISONMODULEINIT(name, symbols)				    \
+BISONMODULETABLES							    \
 void								    \
 init ## name (void) {						    \
   PyObject *pmod = Py_InitModule4(#name, module_methods,	    \
                                   "Bison-generated parser module "  \
                                   #name, NULL, PYTHON_API_VERSION); \
   PyObject *moddict = PyModule_GetDict(pmod);		            \
+  expectedtokens = expected_tokens;				    \
   makesymboldicts(module_symbols, moddict);			    \
+  import_symbols();						    \
   makesyntaxerror(#name, moddict);				    \
+  BISONMODULEPROFILE;						    \
   if (PyErr_Occurred()) {				      	    \
     Py_FatalError("Error initializing parser module #name");	    \
   }								    \
@@ -32,7 +32,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <time.h>
 #include "Python.h"
+#include "FlexModuleAPI.h"
+#include "cSymbols.h"
 
 static int yylex(void);
 
@@ -40,7 +44,7 @@ static int yylex(void);
  * Utility function: Allocate memory, setting exception if needed.
  */
 static void *
-pxmalloc(int size)
+pxmalloc(size_t size)
 {
   void *p;
   p = malloc(size);
@@ -49,48 +53,552 @@ pxmalloc(int size)
 }
 
 /*
- * Track positions and handle flex buffers in the scanned text.
+ * Runtime statistics.  Define FLEXMODULE_STATS before including this
+ * file to compile in the counters; without it, FM_STAT expands to
+ * nothing and stats() returns an empty dictionary.  Timing of the
+ * maketoken callback is further switched on and off at run time by
+ * reset_stats(), so the clock is only read when someone asked.
+ */
+#ifndef FLEXMODULE_STATS_TYPES
+#define FLEXMODULE_STATS_TYPES 1024	/* Token types counted separately */
+#endif
+
+#ifdef FLEXMODULE_STATS
+#define FM_STAT(x) (x)
+#else
+#define FM_STAT(x)
+#endif
+
+struct stats_struct {
+  long types[FLEXMODULE_STATS_TYPES]; /* Tokens returned, by type */
+  long othertypes;		/* Tokens with types beyond the table */
+  long tokens;			/* Tokens returned in all */
+  long long bytes;		/* Bytes of text scanned */
+  long yywraps;			/* Calls to yywrap */
+  int depth;			/* Current depth of the position stack */
+  int maxdepth;			/* Deepest the position stack has been */
+  int timing;			/* Time maketoken if non-zero */
+  double maketoken_time;	/* Seconds spent in maketoken */
+};
+static struct stats_struct scanstats;
+
+#ifdef FLEXMODULE_STATS
+/*
+ * Seconds from an arbitrary starting point, for the timers.
+ */
+static double
+stats_clock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Count a token returned by the scanner.
+ */
+static void
+stats_token(int type)
+{
+  scanstats.tokens++;
+  if (type >= 0 && type < FLEXMODULE_STATS_TYPES) {
+    scanstats.types[type]++;
+  } else {
+    scanstats.othertypes++;
+  }
+}
+#endif
+
+/*
+ * Lexer rule profiling.  Define FLEXMODULE_PROFILE before including
+ * this file and run flex with -d, which makes it keep a table of rule
+ * line numbers (the debugging trace it also enables is switched off
+ * when the module is initialized).  Every rule that matches runs
+ * YY_USER_ACTION first, with the rule number in yy_act, so matches
+ * and matched bytes are counted there, whether or not the rule
+ * returns a token.  A YY_USER_ACTION of your own replaces this one.
+ */
+struct profile_struct {
+  int nrules;			/* Size of the arrays below */
+  long *matches;		/* Matches, by rule number */
+  long long *bytes;		/* Bytes matched, by rule number */
+  PyObject *rules;		/* (file, line) by rule number */
+};
+static struct profile_struct ruleprofile;
+
+#ifdef FLEXMODULE_PROFILE
+static void
+profile_match(int rule, int len)
+{
+  if (rule > 0 && rule < ruleprofile.nrules) {
+    ruleprofile.matches[rule]++;
+    ruleprofile.bytes[rule] += len;
+  }
+}
+
+#ifndef YY_USER_ACTION
+#define YY_USER_ACTION profile_match(yy_act, yyleng);
+#endif
+
+/*
+ * Allocate the profile and remember where each rule came from; called
+ * from FLEXMODULEINIT, where flex's tables are visible.  The default
+ * rule (echoing unmatched text) has no line and is recorded as line 0.
+ */
+static void
+profile_init(const char *file, const long *lines, int nrules)
+{
+  int r;
+  ruleprofile.matches = (long *) calloc(nrules + 1, sizeof(long));
+  ruleprofile.bytes = (long long *) calloc(nrules + 1, sizeof(long long));
+  ruleprofile.rules = PyTuple_New(nrules + 1);
+  if (!ruleprofile.matches || !ruleprofile.bytes) {
+    PyErr_NoMemory();
+    return;
+  }
+  if (!ruleprofile.rules) {
+    return;
+  }
+  for (r = 1; r <= nrules; r++) {
+    PyTuple_SET_ITEM(ruleprofile.rules, r,
+		     Py_BuildValue("(s,l)", file, r < nrules ? lines[r] : 0));
+  }
+  ruleprofile.nrules = nrules + 1;
+}
+#endif
+
+/*
+ * Compressed input.  Define FLEXMODULE_GZIP (and link with -lz) or
+ * FLEXMODULE_ZSTD (and link with -lzstd) before including this file,
+ * and every file scanned, whether opened by onfile or pushed by a
+ * PUSH_FILE macro, is checked for the gzip or zstd magic bytes when it
+ * is opened and decompressed as flex reads it.  Only FLEXMODULE_INPUTBUF
+ * bytes of compressed input are held per open file, so inputs of any
+ * size stream through, and positions count the lines and columns of
+ * the decompressed text as usual.  Files are read through the YY_INPUT
+ * below; with a YY_INPUT of your own, files are read as they are.
+ * Without either option none of this is compiled, and flex reads
+ * files itself.
+ */
+#ifndef FLEXMODULE_INPUTBUF
+#define FLEXMODULE_INPUTBUF 65536	/* Compressed bytes read at a time */
+#endif
+
+#ifdef FLEXMODULE_GZIP
+#include <zlib.h>
+#endif
+#ifdef FLEXMODULE_ZSTD
+#include <zstd.h>
+#endif
+
+#if !defined YY_INPUT && (defined FLEXMODULE_GZIP || defined FLEXMODULE_ZSTD)
+#define YY_INPUT(buf,result,max_size) \
+  ((result) = source_read(scanner.pstack, (buf), (max_size)))
+#define FLEXMODULE_INPUT
+#endif
+
+#ifdef FLEXMODULE_INPUT
+enum { SOURCE_PLAIN, SOURCE_GZIP, SOURCE_ZSTD };
+
+typedef struct {
+  int kind;			/* SOURCE_PLAIN, _GZIP or _ZSTD */
+  int interactive;		/* Plain, and read a line at a time */
+  int eof;			/* Read the end of the file */
+  int ended;			/* At the end of a compressed stream */
+  unsigned char head[4];	/* First bytes, read to find the magic */
+  size_t headlen;		/* Bytes in head */
+  size_t headpos;		/* Bytes of head given to flex */
+  unsigned char *buf;		/* Compressed input, or NULL if plain */
+#ifdef FLEXMODULE_GZIP
+  z_stream z;			/* Inflate state and input */
+#endif
+#ifdef FLEXMODULE_ZSTD
+  ZSTD_DStream *zstd;		/* Decompression state */
+  ZSTD_inBuffer zin;		/* Input within buf */
+#endif
+} source;
+#endif
+
+/*
+ * Position profiles.  Define FLEXMODULE_POSITIONS before including
+ * this file to choose what a token's position holds, and so what every
+ * token pays for it:
+ *
+ * FLEXMODULE_POS_LINECOL  lines and columns (the default)
+ * FLEXMODULE_POS_LINES    lines only; the columns are 0
+ * FLEXMODULE_POS_OFFSETS  byte offsets into the file in place of the
+ *                         columns, from the start of the token to just
+ *                         past its end; the lines are 0
+ * FLEXMODULE_POS_NONE     nothing; maketoken is given None for the
+ *                         position, and ScannedToken a context of None
+ *
+ * The position tuple keeps its shape in the first three, so that
+ * Symbols.position, cSymbols.pack and the like need not know which is
+ * in use.
+ */
+#define FLEXMODULE_POS_LINECOL 0
+#define FLEXMODULE_POS_LINES 1
+#define FLEXMODULE_POS_OFFSETS 2
+#define FLEXMODULE_POS_NONE 3
+
+#ifndef FLEXMODULE_POSITIONS
+#define FLEXMODULE_POSITIONS FLEXMODULE_POS_LINECOL
+#endif
+
+/*
+ * Track positions and handle flex buffers in the scanned text.  Lines,
+ * columns and lengths are 64 bits wide, so that inputs (and lines)
+ * over 2 GB are counted correctly.
+ *
+ * A closed position is kept for the next one, with the space for its
+ * file name and string and its flex buffer for files, so that scanning
+ * many small inputs does not allocate them over and over.
  */
 typedef struct position_struct {
-  struct position_struct *next;	/* Next stacked position */
+  struct position_struct *next;	/* Next stacked (or pooled) position */
   char *filename;		/* File name of position; "-" for strings */
-  int cur_line;			/* Current line number in file */
-  int cur_col;			/* Current character number within line */
-  int pre_line;			/* Previous line number */
-  int pre_col;			/* Previous column number */
+  size_t filenamesize;		/* Space allocated for filename */
+  linecol cur_line;		/* Current line number in file */
+  linecol cur_col;		/* Current character number within line */
+  linecol pre_line;		/* Previous line number */
+  linecol pre_col;		/* Previous column number */
   YY_BUFFER_STATE buf;		/* Flex buffer state */
+  YY_BUFFER_STATE filebuf;	/* Flex buffer for files, kept */
+  PyObject *context;		/* (filename, [stacked positions]), or
+				   NULL until a token needs it */
   /* File */
   FILE *file;			/* File to be scanned */
   PyObject *file_object;	/* Saved file object reference */
+#ifdef FLEXMODULE_INPUT
+  source *input;		/* How the file is read, or NULL if
+				   flex reads it itself */
+  source src;			/* What input points to */
+#endif
   /* String */
   char *string;			/* String to be scanned */
+  Py_ssize_t stringsize;	/* Space allocated for string */
 } position;
 
+#ifndef FLEXMODULE_POOL
+#define FLEXMODULE_POOL 8		/* Closed positions kept for reuse */
+#endif
+#ifndef FLEXMODULE_POOLSTRING
+#define FLEXMODULE_POOLSTRING 1048576	/* Most string space kept */
+#endif
+
+static position *posfree = NULL;	/* Closed positions */
+static int nposfree = 0;
+
+static void drop_pos(position *p);
+
+#ifdef FLEXMODULE_INPUT
+/*
+ * Read a file into buf, as flex's own YY_INPUT does.  Returns the
+ * bytes read, 0 at the end of the file, or -1 with an IOError set.
+ */
+static long
+source_fread(position *p, void *buf, size_t max)
+{
+  size_t n;
+  errno = 0;
+  while (!(n = fread(buf, 1, max, p->file)) && ferror(p->file)) {
+    if (errno != EINTR) {
+      PyErr_SetFromErrnoWithFilename(PyExc_IOError, p->filename);
+      return -1;
+    }
+    errno = 0;
+    clearerr(p->file);
+  }
+  return (long) n;
+}
+
+/*
+ * Report bad compressed input.  Returns -1, for source_read's readers.
+ */
+static long
+source_error(position *p, const char *what, const char *why)
+{
+  PyErr_Format(PyExc_IOError, "%s: %s%s%s", p->filename, what,
+	       why ? ": " : "", why ? why : "");
+  return -1;
+}
+
 /*
- * Set up a position.  Note: Don't call this function; use one of the
- * specific versions below.
+ * Read an uncompressed file, handing over the bytes already read to
+ * look for a magic number first.  Terminals are read a line at a time,
+ * as flex reads interactive input.
+ */
+static long
+source_plain(position *p, char *buf, size_t max)
+{
+  source *s = p->input;
+  size_t n = 0;
+  int c = '*';
+  while (s->headpos < s->headlen && n < max) {
+    buf[n++] = s->head[s->headpos++];
+  }
+  if (n) {
+    return (long) n;
+  }
+  if (!s->interactive) {
+    return source_fread(p, buf, max);
+  }
+  while (n < max && (c = getc(p->file)) != EOF && c != '\n') {
+    buf[n++] = (char) c;
+  }
+  if (c == '\n') {
+    buf[n++] = (char) c;
+  }
+  if (c == EOF && ferror(p->file)) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, p->filename);
+    return -1;
+  }
+  return (long) n;
+}
+
+#ifdef FLEXMODULE_GZIP
+/*
+ * Inflate a gzip file.  A file may hold several gzip members one after
+ * another (as cat makes of two .gz files); they are read as one.
+ */
+static long
+source_gzip(position *p, char *buf, size_t max)
+{
+  source *s = p->input;
+  long n;
+  int rc;
+  s->z.next_out = (Bytef *) buf;
+  s->z.avail_out = (uInt) max;
+  while (s->z.next_out == (Bytef *) buf) {
+    if (!s->z.avail_in && !s->eof) {
+      if ((n = source_fread(p, s->buf, FLEXMODULE_INPUTBUF)) < 0) {
+	return -1;
+      }
+      s->eof = !n;
+      s->z.next_in = s->buf;
+      s->z.avail_in = (uInt) n;
+    }
+    if (s->ended) {		/* Done with the last member */
+      if (!s->z.avail_in) {
+	return 0;
+      }
+      if (inflateReset(&s->z) != Z_OK) {
+	return source_error(p, "corrupt gzip data", s->z.msg);
+      }
+      s->ended = 0;
+    }
+    rc = inflate(&s->z, Z_NO_FLUSH);
+    if (rc == Z_STREAM_END) {
+      s->ended = 1;
+    } else if (rc == Z_BUF_ERROR && s->eof) {
+      return source_error(p, "truncated gzip data", NULL);
+    } else if (rc == Z_MEM_ERROR) {
+      PyErr_NoMemory();
+      return -1;
+    } else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+      return source_error(p, "corrupt gzip data", s->z.msg);
+    }
+  }
+  return (long) ((char *) s->z.next_out - buf);
+}
+#endif
+
+#ifdef FLEXMODULE_ZSTD
+/*
+ * Decompress a zstd file, which may likewise hold several frames.
+ */
+static long
+source_zstd(position *p, char *buf, size_t max)
+{
+  source *s = p->input;
+  ZSTD_outBuffer out;
+  size_t rc;
+  long n;
+  out.dst = buf;
+  out.size = max;
+  out.pos = 0;
+  while (!out.pos) {
+    if (s->zin.pos == s->zin.size && !s->eof) {
+      if ((n = source_fread(p, s->buf, FLEXMODULE_INPUTBUF)) < 0) {
+	return -1;
+      }
+      s->eof = !n;
+      s->zin.src = s->buf;
+      s->zin.size = (size_t) n;
+      s->zin.pos = 0;
+    }
+    if (s->ended && s->zin.pos == s->zin.size) {
+      return 0;			/* Done with the last frame */
+    }
+    rc = ZSTD_decompressStream(s->zstd, &out, &s->zin);
+    if (ZSTD_isError(rc)) {
+      return source_error(p, "corrupt zstd data", ZSTD_getErrorName(rc));
+    }
+    s->ended = !rc;
+    if (!out.pos && !s->ended && s->eof && s->zin.pos == s->zin.size) {
+      return source_error(p, "truncated zstd data", NULL);
+    }
+  }
+  return (long) out.pos;
+}
+#endif
+
+/*
+ * YY_INPUT: fill flex's buffer from the file on top of the position
+ * stack.  On an error, the exception is left set and flex is told the
+ * file has ended; yywrap and scan take it from there.
+ */
+static int
+source_read(position *p, char *buf, size_t max)
+{
+  long n = 0;
+  if (!p || !p->input) {
+    return 0;
+  }
+  switch (p->input->kind) {
+  case SOURCE_PLAIN:
+    n = source_plain(p, buf, max);
+    break;
+#ifdef FLEXMODULE_GZIP
+  case SOURCE_GZIP:
+    n = source_gzip(p, buf, max);
+    break;
+#endif
+#ifdef FLEXMODULE_ZSTD
+  case SOURCE_ZSTD:
+    n = source_zstd(p, buf, max);
+    break;
+#endif
+  }
+  return n < 0 ? 0 : (int) n;
+}
+
+/*
+ * Set up reading a file, deciding from its first bytes whether to
+ * decompress it.  Returns 0 with an exception set on failure, leaving
+ * p->input for close_pos to end.
+ */
+static int
+source_open(position *p)
+{
+  source *s = &p->src;
+  unsigned char *buf = s->buf;	/* Keep the compressed input space */
+  long n;
+  memset(s, 0, sizeof(source));
+  s->buf = buf;
+  s->kind = SOURCE_PLAIN;
+  p->input = s;
+  if (isatty(fileno(p->file))) { /* Nothing to look at yet */
+    s->interactive = 1;
+    return 1;
+  }
+  if ((n = source_fread(p, s->head, sizeof(s->head))) < 0) {
+    return 0;
+  }
+  s->headlen = (size_t) n;
+#ifdef FLEXMODULE_GZIP
+  if (n >= 2 && s->head[0] == 0x1f && s->head[1] == 0x8b) {
+    if (!s->buf
+	&& !(s->buf = (unsigned char *) pxmalloc(FLEXMODULE_INPUTBUF))) {
+      return 0;
+    }
+    memcpy(s->buf, s->head, n);	/* Start inflating with the magic */
+    s->z.next_in = s->buf;
+    s->z.avail_in = (uInt) n;
+    if (inflateInit2(&s->z, 15 + 16) != Z_OK) { /* 16: gzip wrapper */
+      PyErr_NoMemory();
+      return 0;
+    }
+    s->kind = SOURCE_GZIP;
+    return 1;
+  }
+#endif
+#ifdef FLEXMODULE_ZSTD
+  if (n == 4 && !memcmp(s->head, "\x28\xb5\x2f\xfd", 4)) {
+    if (!s->buf
+	&& !(s->buf = (unsigned char *) pxmalloc(FLEXMODULE_INPUTBUF))) {
+      return 0;
+    }
+    memcpy(s->buf, s->head, n);
+    s->zin.src = s->buf;
+    s->zin.size = (size_t) n;
+    s->zin.pos = 0;
+    if (!(s->zstd = ZSTD_createDStream())) {
+      PyErr_NoMemory();
+      return 0;
+    }
+    s->kind = SOURCE_ZSTD;
+    if (ZSTD_isError(ZSTD_initDStream(s->zstd))) {
+      PyErr_NoMemory();
+      return 0;
+    }
+    return 1;
+  }
+#endif
+  return 1;			/* Plain; head goes to flex first */
+}
+
+/*
+ * End a file's source, keeping its buffer.
+ */
+static void
+source_close(source *s)
+{
+#ifdef FLEXMODULE_GZIP
+  if (s->kind == SOURCE_GZIP) {
+    inflateEnd(&s->z);
+  }
+#endif
+#ifdef FLEXMODULE_ZSTD
+  if (s->kind == SOURCE_ZSTD) {
+    ZSTD_freeDStream(s->zstd);
+  }
+#endif
+  s->kind = SOURCE_PLAIN;
+}
+#endif
+
+/*
+ * Set up a position, reusing a closed one if there is one.  Note:
+ * Don't call this function; use one of the specific versions below.
  */
 static position *
 set_pos_base(char *fn)
 {
-  position *p = (position *) pxmalloc(sizeof(position));
-  if (!p) { return NULL; }
-  if (fn) {			/* Duplicate the file name */
-    int len = strlen(fn);
-    p->filename = (char *) pxmalloc(len + 1);
-    if (!p->filename) {
-      free(p);
+  position *p = posfree;
+  size_t len = strlen(fn);
+  if (p) {			/* Take a closed position */
+    posfree = p->next;
+    nposfree--;
+  } else {
+    if (!(p = (position *) pxmalloc(sizeof(position)))) {
       return NULL;
     }
-    memcpy(p->filename, fn, len);
-    p->filename[len] = 0;    
+    memset(p, 0, sizeof(position));
   }
-  p->pre_line = p->cur_line = 1; /* Initialize the position */
-  p->pre_col = p->cur_col = 1;
-  p->file = NULL;		/* These will be dealt with below */
-  p->file_object = NULL;
-  p->string = NULL;
   p->next = NULL;
+  if (len >= p->filenamesize) {	/* Make room for the file name */
+    free(p->filename);
+    p->filenamesize = 0;
+    if (!(p->filename = (char *) pxmalloc(len + 1))) {
+      drop_pos(p);
+      return NULL;
+    }
+    p->filenamesize = len + 1;
+  }
+  memcpy(p->filename, fn, len);	/* Duplicate the file name */
+  p->filename[len] = 0;
+				/* Initialize the position */
+#if FLEXMODULE_POSITIONS == FLEXMODULE_POS_OFFSETS
+  p->pre_line = p->cur_line = 0;
+#else
+  p->pre_line = p->cur_line = 1;
+#endif
+#if FLEXMODULE_POSITIONS == FLEXMODULE_POS_LINECOL
+  p->pre_col = p->cur_col = 1;
+#else
+  p->pre_col = p->cur_col = 0;
+#endif
   return p;
 }
 
@@ -98,16 +606,19 @@ set_pos_base(char *fn)
  * Grab a string and make it a flex buffer.
  */
 static position *
-set_pos_string(char *s, int s_len)
+set_pos_string(const char *s, Py_ssize_t s_len)
 {
   position *p = set_pos_base("-");
   if (!p) { return NULL; }
 				/* Duplicate the string as a flex buffer */
-  p->string = (char *) pxmalloc(s_len + 2);
-  if (!p->string) {
-    free(p->filename);
-    free(p);
-    return 0;
+  if (s_len + 2 > p->stringsize) {
+    free(p->string);
+    p->stringsize = 0;
+    if (!(p->string = (char *) pxmalloc(s_len + 2))) {
+      drop_pos(p);
+      return NULL;
+    }
+    p->stringsize = s_len + 2;
   }
   memcpy(p->string, s, s_len);
 				/* The last two characters are special */
@@ -133,8 +644,20 @@ set_pos_file_unowned(char * fn, FILE *f, PyObject *fileobj)
                                    below), this doesn't care. */
   Py_XINCREF(fileobj);		/* Don't let anyone else close the file */
   p->file_object = fileobj;	/* while it's in use here. */
-  p->buf = yy_create_buffer(f, YY_BUF_SIZE);
-  yy_switch_to_buffer(p->buf);	/* Tell flex to use it */
+#ifdef FLEXMODULE_INPUT
+  if (!source_open(p)) {	/* See if it is compressed */
+    drop_pos(p);
+    return NULL;
+  }
+#endif
+  if (p->filebuf) {		/* Tell flex to use the kept buffer */
+    yy_switch_to_buffer(p->filebuf);
+    yyrestart(f);
+  } else {
+    p->filebuf = yy_create_buffer(f, YY_BUF_SIZE);
+    yy_switch_to_buffer(p->filebuf);
+  }
+  p->buf = p->filebuf;
   return p;
 }
 
@@ -161,9 +684,10 @@ set_pos_file_owned(char *fn)
  * been seen.
  */
 static void
-advance_pos(position *p, char *text, int len)
+advance_pos(position *p, const char *text, Py_ssize_t len)
 {
-  int i;
+#if FLEXMODULE_POSITIONS == FLEXMODULE_POS_LINECOL
+  Py_ssize_t i;
   p->pre_line = p->cur_line;	/* Record the previous location */
   p->pre_col = p->cur_col;
   for (i = 0; i < len; i++) {	/* Advance the current location */
@@ -174,6 +698,18 @@ advance_pos(position *p, char *text, int len)
       p->cur_col++;
     }
   }
+#elif FLEXMODULE_POSITIONS == FLEXMODULE_POS_LINES
+  const char *end = text + len;
+  p->pre_line = p->cur_line;
+  while ((text = memchr(text, '\n', end - text))) { /* Count newlines */
+    p->cur_line++;
+    text++;
+  }
+#elif FLEXMODULE_POSITIONS == FLEXMODULE_POS_OFFSETS
+  p->pre_col = p->cur_col;
+  p->cur_col += len;
+#endif
+  FM_STAT(scanstats.bytes += len);
 }
 
 /*
@@ -186,15 +722,11 @@ advance_pos(position *p, char *text, int len)
 #define ADVANCE       ADVANCE2(yytext, yyleng)
 
 /*
- * Clean up a position.
+ * Clean up a position, letting go of its input but keeping its space.
  */
 static void
 close_pos(position *p)
 {
-  if (p->filename) {
-    free(p->filename);
-  }
-  p->filename = 0;
   if (p->file && !p->file_object) {
     fclose(p->file);
   }
@@ -203,25 +735,151 @@ close_pos(position *p)
     Py_DECREF(p->file_object);
   }
   p->file_object = NULL;
-  if (p->string) {
-    free(p->string);
+#ifdef FLEXMODULE_INPUT
+  if (p->input) {
+    source_close(p->input);
   }
-  p->string = NULL;
-  if (p->buf) {
-    yy_delete_buffer(p->buf);
+  p->input = NULL;
+#endif
+  if (p->buf && p->buf != p->filebuf) {
+    yy_delete_buffer(p->buf);	/* A string's buffer */
   }
   p->buf = 0;
+  Py_XDECREF(p->context);
+  p->context = NULL;
+}
+
+/*
+ * Free a closed position.
+ */
+static void
+free_pos(position *p)
+{
+  if (p->filebuf) {
+    yy_delete_buffer(p->filebuf);
+  }
+#ifdef FLEXMODULE_INPUT
+  free(p->src.buf);
+#endif
+  free(p->string);
+  free(p->filename);
+  free(p);
+}
+
+/*
+ * Close a position and keep it for reuse, unless enough are kept
+ * already.  A string space that has grown large is let go.
+ */
+static void
+drop_pos(position *p)
+{
+  close_pos(p);
+  if (nposfree >= FLEXMODULE_POOL) {
+    free_pos(p);
+    return;
+  }
+  if (p->stringsize > FLEXMODULE_POOLSTRING) {
+    free(p->string);
+    p->string = NULL;
+    p->stringsize = 0;
+  }
+  p->next = posfree;
+  posfree = p;
+  nposfree++;
 }
 
+/*
+ * Free the kept positions.
+ */
+static void
+release_pos(void)
+{
+  while (posfree) {
+    position *next = posfree->next;
+    free_pos(posfree);
+    posfree = next;
+  }
+  nposfree = 0;
+}
+
+/*
+ * Lookahead.  peek(n) scans tokens ahead of the reader and keeps them
+ * in a ring of records, each holding a copy of the text, the position
+ * and context as scanned, and the token object once one is made;
+ * readtoken, Scanner iterators and the scannerapi read from the ring
+ * before scanning any more.  The last token read is kept the same way,
+ * so lasttoken() returns the object already made for it.  Without
+ * peeking, tokens still come straight from flex, and the last one is
+ * only copied out of yytext when a peek is about to overwrite it.
+ */
+typedef struct {
+  ScannedToken tok;		/* The token; tok.text points into buf,
+				   and tok.context is owned */
+  char *buf;			/* Copy of the text */
+  Py_ssize_t bufsize;		/* Size of buf */
+  PyObject *object;		/* Token made by maketoken, or NULL */
+} tokenrecord;
+
 /*
  * The information needed by the scanner.
  */
 struct scanner_struct {
   PyObject *maketoken;		/* Python function to make tokens */
   position *pstack;		/* Current positions */
-  int lasttoken;		/* Return value of last call to yylex */
+  int lasttoken;		/* Type of the last token read */
+  long generation;		/* Count of onstring, onfile and close */
+  /* Lookahead */
+  tokenrecord *ring;		/* Tokens peeked at, not yet read */
+  int ringsize;			/* Records allocated in ring */
+  int ringhead;			/* Index of the next token to read */
+  int ringcount;		/* Tokens waiting in ring; the last may
+				   be the end of the input (type 0) */
+  tokenrecord last;		/* The last token read, unless lastlive */
+  int lastlive;			/* The last token read is in yytext */
+  /* Limits; 0 for none */
+  double deadline;		/* time.time() to stop scanning at */
+  long maxtokens;		/* Tokens to scan */
+  int maxdepth;			/* Depth of PUSH_FILE includes */
+  long ntokens;			/* Tokens scanned so far */
 };
-static struct scanner_struct scanner = { NULL, NULL, 0, };
+static struct scanner_struct scanner = { NULL, NULL, 0, 0, };
+
+/*
+ * Limits, for scanning untrusted input on a budget.  onstring and
+ * onfile may be given a deadline (a time.time() value), a number of
+ * tokens and a depth of PUSH_FILE includes.  The clock is read once
+ * every FLEXMODULE_CLOCKEVERY tokens.  Going over a limit raises
+ * LimitExceeded and closes the scan, freeing the position stack.
+ */
+#ifndef FLEXMODULE_CLOCKEVERY
+#define FLEXMODULE_CLOCKEVERY 64
+#endif
+
+static PyObject *LimitExceeded = NULL;	/* Exception raised at a limit */
+
+/*
+ * Check the limits after a token; returns -1 with LimitExceeded set
+ * if one has been passed.
+ */
+static int
+scan_limits(void)
+{
+  struct timespec ts;
+  if (scanner.maxtokens && scanner.ntokens > scanner.maxtokens) {
+    PyErr_Format(LimitExceeded, "token limit exceeded (%ld)",
+		 scanner.maxtokens);
+    return -1;
+  }
+  if (scanner.deadline
+      && scanner.ntokens % FLEXMODULE_CLOCKEVERY == 1) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (ts.tv_sec + ts.tv_nsec * 1e-9 >= scanner.deadline) {
+      PyErr_SetString(LimitExceeded, "scan deadline passed");
+      return -1;
+    }
+  }
+  return 0;
+}
 
 /*
  * Check if we are currently scanning something.
@@ -229,7 +887,61 @@ static struct scanner_struct scanner = { NULL, NULL, 0, };
 static int
 scanning(void)
 {
-  return (scanner.maketoken && scanner.pstack);
+  return (scanner.maketoken && (scanner.pstack || scanner.ringcount));
+}
+
+/*
+ * Let go of a token record's references, keeping its text buffer.
+ */
+static void
+record_clear(tokenrecord *r)
+{
+  Py_CLEAR(r->tok.context);
+  Py_CLEAR(r->object);
+  r->tok.type = 0;
+}
+
+/*
+ * Copy a scanned token into a record.  Returns 0 with an exception set
+ * if there is no memory for the text.
+ */
+static int
+record_set(tokenrecord *r, ScannedToken *tok)
+{
+  if (tok->len >= r->bufsize) {	/* Make room for the text */
+    Py_ssize_t n = r->bufsize ? r->bufsize : 64;
+    char *buf;
+    while (tok->len >= n) {
+      n *= 2;
+    }
+    if (!(buf = (char *) pxmalloc(n))) {
+      return 0;
+    }
+    free(r->buf);
+    r->buf = buf;
+    r->bufsize = n;
+  }
+  memcpy(r->buf, tok->text, tok->len);
+  Py_XINCREF(tok->context);
+  Py_XDECREF(r->tok.context);
+  r->tok = *tok;
+  r->tok.text = r->buf;
+  return 1;
+}
+
+/*
+ * Forget any tokens peeked at and the last token read.
+ */
+static void
+clearlookahead(void)
+{
+  int i;
+  for (i = 0; i < scanner.ringcount; i++) {
+    record_clear(&scanner.ring[(scanner.ringhead + i) % scanner.ringsize]);
+  }
+  scanner.ringhead = scanner.ringcount = 0;
+  record_clear(&scanner.last);
+  scanner.lastlive = 0;
 }
 
 /*
@@ -238,13 +950,28 @@ scanning(void)
 static int
 push_position(char *fn)
 {
+  position *p;
+  if (scanner.maxdepth) {	/* Count the open positions */
+    int depth = 0;
+    for (p = scanner.pstack; p; p = p->next) {
+      depth++;
+    }
+    if (depth >= scanner.maxdepth) {
+      PyErr_Format(LimitExceeded, "include depth exceeded (%d)",
+		   scanner.maxdepth);
+      return 0;
+    }
+  }
 				/* Create a position and open the file */
-  position *p = set_pos_file_owned(fn);
+  p = set_pos_file_owned(fn);
   if (!p) {
     return 0;
   }
   p->next = scanner.pstack;	/* Put it at the top of the stack */
   scanner.pstack = p;
+  FM_STAT(scanstats.depth++);
+  FM_STAT(scanstats.maxdepth = scanstats.depth > scanstats.maxdepth
+	  ? scanstats.depth : scanstats.maxdepth);
   return 1;
 }
 
@@ -252,7 +979,7 @@ push_position(char *fn)
  * Push a position based on a char pointer and a length.
  */
 static int
-push_position2(char *begin, int len)
+push_position2(const char *begin, Py_ssize_t len)
 {
   int res = 0;
   char *buf = (char *) pxmalloc(len + 1);
@@ -287,10 +1014,14 @@ push_position2(char *begin, int len)
 static int
 yywrap(void)
 {
-  position *p = scanner.pstack;	/* Close and free the top of the stack */
-  scanner.pstack = p->next;
-  close_pos(p);
-  free(p);
+  position *p = scanner.pstack;
+  if (PyErr_Occurred()) {	/* Reading failed; leave the stack for */
+    return 1;			/* close */
+  }
+  scanner.pstack = p->next;	/* Close the top of the stack */
+  drop_pos(p);
+  FM_STAT(scanstats.yywraps++);
+  FM_STAT(scanstats.depth--);
   if (!scanner.pstack) {	/* If that was the last position, quit */
      return 1;
   }
@@ -299,47 +1030,163 @@ yywrap(void)
   return 0;
 }
 
+/*
+ * Scanner objects, returned by onstring and onfile, iterate over the
+ * tokens, giving the same pairs as readtoken.  There is still only the
+ * one scanner in the module; a Scanner just remembers the generation
+ * of the call that made it, and stops once that scan is closed or
+ * replaced.
+ */
+typedef struct {
+  PyObject_HEAD
+  long generation;		/* scanner.generation when created */
+} ScannerObject;
+
+static PyObject *scanner_iternext(PyObject *self);
+
+static void
+scanner_dealloc(PyObject *self)
+{
+  PyObject_Del(self);
+}
+
+static PyTypeObject ScannerType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "FlexModule.Scanner",		/* tp_name */
+  sizeof(ScannerObject),	/* tp_basicsize */
+  0,				/* tp_itemsize */
+  scanner_dealloc,		/* tp_dealloc */
+  0,				/* tp_print */
+  0,				/* tp_getattr */
+  0,				/* tp_setattr */
+  0,				/* tp_compare */
+  0,				/* tp_repr */
+  0,				/* tp_as_number */
+  0,				/* tp_as_sequence */
+  0,				/* tp_as_mapping */
+  0,				/* tp_hash */
+  0,				/* tp_call */
+  0,				/* tp_str */
+  0,				/* tp_getattro */
+  0,				/* tp_setattro */
+  0,				/* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT,		/* tp_flags */
+  "Iterator over the tokens of a scan, as (type, token) pairs",
+  0,				/* tp_traverse */
+  0,				/* tp_clear */
+  0,				/* tp_richcompare */
+  0,				/* tp_weaklistoffset */
+  PyObject_SelfIter,		/* tp_iter */
+  scanner_iternext,		/* tp_iternext */
+};
+
+/*
+ * Start a new generation of the scanner and return a Scanner for it.
+ */
+static PyObject *
+newscanner(void)
+{
+  ScannerObject *ob = PyObject_New(ScannerObject, &ScannerType);
+  if (ob) {
+    ob->generation = scanner.generation;
+  }
+  return (PyObject *) ob;
+}
+
+/*
+ * Check the limits given to onstring or onfile.
+ */
+static int
+checklimits(double deadline, long max_tokens, int max_depth)
+{
+  if (deadline < 0 || max_tokens < 0 || max_depth < 0) {
+    PyErr_SetString(PyExc_ValueError, "limits must not be negative");
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * Start scanning from the position p, made by onstring or onfile,
+ * and return a Scanner for the scan.
+ */
+static PyObject *
+startscan(PyObject *maketoken, position *p,
+	  double deadline, long max_tokens, int max_depth)
+{
+  clearlookahead();		/* Forget the last scan's tokens */
+  scanner.lasttoken = 0;
+  scanner.pstack = p;
+  Py_XDECREF(scanner.maketoken); /* Grab maketoken */
+  Py_INCREF(maketoken);
+  scanner.maketoken = maketoken;
+  scanner.deadline = deadline;
+  scanner.maxtokens = max_tokens;
+  scanner.maxdepth = max_depth;
+  scanner.ntokens = 0;
+  FM_STAT(scanstats.depth = 1);
+  FM_STAT(scanstats.maxdepth = scanstats.maxdepth > 1 ? scanstats.maxdepth : 1);
+  scanner.generation++;
+  return newscanner();
+}
+
 /*
  * Python function to begin scanning a string.
  * Parameters are:
  * - Python function to create tokens; see the doc string.
  * - A string to scan.
- * This function uses goto's to handle clean-up after errors.
+ * - Optionally, the limits.
  */
 static PyObject *
-c_onstring(PyObject * self, PyObject * args)
+c_onstring(PyObject * self, PyObject * args, PyObject * kwds)
 {
-  char *s;
-  int s_len;
-  Py_XDECREF(scanner.maketoken);
-  if (!PyArg_ParseTuple(args, "Os#", &scanner.maketoken, &s, &s_len)) {
+  static char *kwlist[] = {"maketoken", "string", "deadline", "max_tokens",
+			   "max_depth", NULL};
+  PyObject *maketoken, *string;
+  const char *s;
+  Py_ssize_t s_len;		/* Not s#, whose length is an int */
+  double deadline = 0;
+  long max_tokens = 0;
+  int max_depth = 0;
+  position *p;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|dli", kwlist,
+				   &maketoken, &string, &deadline,
+				   &max_tokens, &max_depth)
+      || !checklimits(deadline, max_tokens, max_depth)
+      || PyObject_AsCharBuffer(string, &s, &s_len) < 0) {
     return NULL;
   }
   if (scanning()) {
     PyErr_SetString(PyExc_ValueError, "Already scanning");
     return NULL;
   }
-  scanner.pstack = set_pos_string(s, s_len);
-  if (!scanner.pstack) {
+  if (!(p = set_pos_string(s, s_len))) {
     return NULL;
   }
-  Py_INCREF(scanner.maketoken);	/* Grab maketoken */
-  Py_INCREF(Py_None);		/* Return normally */
-  return Py_None;
+  return startscan(maketoken, p, deadline, max_tokens, max_depth);
 }
 
 /*
  * Python function to begin scanning a file.
  * Parameters are:
  * - Python function to create tokens; see the doc string.
- * - The file name.
- * This function uses goto's to handle clean-up after errors.
+ * - The file name or a file object.
+ * - Optionally, the limits.
  */
 static PyObject *
-c_onfile(PyObject * self, PyObject * args)
+c_onfile(PyObject * self, PyObject * args, PyObject * kwds)
 {
-  PyObject *fileobj;
-  if (!PyArg_ParseTuple(args, "OO", &scanner.maketoken, &fileobj)) {
+  static char *kwlist[] = {"maketoken", "file", "deadline", "max_tokens",
+			   "max_depth", NULL};
+  PyObject *maketoken, *fileobj;
+  double deadline = 0;
+  long max_tokens = 0;
+  int max_depth = 0;
+  position *p;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|dli", kwlist,
+				   &maketoken, &fileobj, &deadline,
+				   &max_tokens, &max_depth)
+      || !checklimits(deadline, max_tokens, max_depth)) {
     return NULL;
   }
   if (scanning()) {
@@ -348,86 +1195,360 @@ c_onfile(PyObject * self, PyObject * args)
   }
   if (PyString_Check(fileobj)) {
 				/* It's a file name, ours to close */
-    scanner.pstack = set_pos_file_owned(PyString_AsString(fileobj));
+    p = set_pos_file_owned(PyString_AsString(fileobj));
   } else if (PyFile_Check(fileobj)) {
 				/* It's a Python file object; let the
 				   caller close the damn thing.  We
 				   do need to keep a reference, in case
 				   it disappears while we aren't looking. */
-    scanner.pstack =
-      set_pos_file_unowned(PyString_AsString(PyFile_Name(fileobj)),
-			   PyFile_AsFile(fileobj), fileobj);
+    p = set_pos_file_unowned(PyString_AsString(PyFile_Name(fileobj)),
+			     PyFile_AsFile(fileobj), fileobj);
   } else {
     PyErr_SetString(PyExc_ValueError, "Need filename or file object");
     return NULL;
   }
-  if (!scanner.pstack) {	/* If set_pos_file failed, head for hills */
+  if (!p) {			/* If set_pos_file failed, head for hills */
     return NULL;
   }
-  Py_INCREF(scanner.maketoken);	/* Grab maketoken */
-  Py_INCREF(Py_None);		/* Return normally */
-  return Py_None;
+  return startscan(maketoken, p, deadline, max_tokens, max_depth);
 }
 
 /*
- * Python function to shut down scanner.
- * Has no parameters.
+ * Stop scanning: let go of maketoken, free the position stack and
+ * stop any Scanner objects.
  */
-static PyObject *
-c_close(PyObject * self, PyObject * args)
+static void
+closescan(void)
 {
-  if (!PyArg_ParseTuple(args, "")) { return NULL; }
   if (scanner.maketoken) {	/* Shut down maketoken */
     Py_DECREF(scanner.maketoken);
     scanner.maketoken = NULL;
   }
   while (scanner.pstack) {	/* Clean out the position stack */
     position *next = scanner.pstack->next;
-    close_pos(scanner.pstack);
-    free(scanner.pstack);
+    drop_pos(scanner.pstack);
     scanner.pstack = next;
   }
+  clearlookahead();		/* and any tokens kept */
   scanner.lasttoken = 0;	/* Clear the last token value */
+  scanner.generation++;		/* Stop any Scanner objects */
+  FM_STAT(scanstats.depth = 0);
+}
+
+/*
+ * Python function to shut down scanner.
+ * Has no parameters.
+ */
+static PyObject *
+c_close(PyObject * self, PyObject * args)
+{
+  if (!PyArg_ParseTuple(args, "")) { return NULL; }
+  closescan();
   Py_INCREF(Py_None);
   return Py_None;
 }
 
 /*
- * Call maketoken.
+ * Python function to free the positions, buffers and token records
+ * kept from earlier scans.  The current scan, if any, keeps its own.
  */
 static PyObject *
-maketoken(void)
+c_release(PyObject * self, PyObject * args)
 {
-  position *p;
-  PyObject *token, *ptuple, *list = PyList_New(0);
-  if (!list) {
+  int i;
+  if (!PyArg_ParseTuple(args, "")) { return NULL; }
+  release_pos();
+  if (!scanner.ringcount) {	/* No tokens waiting in the ring */
+    for (i = 0; i < scanner.ringsize; i++) {
+      free(scanner.ring[i].buf);
+    }
+    free(scanner.ring);
+    scanner.ring = NULL;
+    scanner.ringsize = scanner.ringhead = 0;
+  }
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+/*
+ * Return the context of a position: a tuple of its file name and the
+ * list of stacked positions under it.  The positions underneath do not
+ * move while this one is on top, so the tuple is built once and shared
+ * by every token from the position; don't modify the list.  Returns a
+ * borrowed reference; None if positions are not kept.
+ */
+static PyObject *
+position_context(position *p)
+{
+#if FLEXMODULE_POSITIONS == FLEXMODULE_POS_NONE
+  return Py_None;		/* Nothing to say */
+#else
+  position *q;
+  PyObject *ptuple, *list;
+  if (p->context) {
+    return p->context;
+  }
+  if (!(list = PyList_New(0))) {
     return NULL;
   }
 				/* Set up the list of open positions,
                                    starting from the second-to-last */
-  for (p = scanner.pstack->next; p; p = p->next) {
-    ptuple = Py_BuildValue("(s,i,i)", p->filename, p->cur_line, p->cur_col);
+  for (q = p->next; q; q = q->next) {
+    ptuple = Py_BuildValue("(s," LINECOL_FORMAT "," LINECOL_FORMAT ")",
+			   q->filename, q->cur_line, q->cur_col);
     if (!ptuple || (PyList_Append(list, ptuple) < 0)) {
+      Py_XDECREF(ptuple);
       Py_DECREF(list);
       return NULL;
     }
     Py_DECREF(ptuple);
+  }
+  p->context = Py_BuildValue("(s,O)", p->filename, list);
+  Py_DECREF(list);
+  return p->context;
+#endif
+}
+
+/*
+ * Describe the token just scanned, without creating any Python
+ * objects but (once per position) its context.
+ */
+static int
+scanned(ScannedToken *tok)
+{
+  position *p = scanner.pstack;
+  tok->type = scanner.lasttoken;
+  tok->text = yytext;
+  tok->len = yyleng;
+  tok->pre_line = p->pre_line;
+  tok->pre_col = p->pre_col;
+  tok->cur_line = p->cur_line;
+  tok->cur_col = p->cur_col;
+  tok->context = position_context(p);
+  return tok->context ? tok->type : -1;
+}
+
+/*
+ * Call maketoken, or have cSymbols make the token without calling it
+ * if maketoken is a cSymbols Factory or class.
+ */
+static PyObject *
+calltoken(ScannedToken *tok, PyObject *ptuple)
+{
+  if (symbolsapi) {
+    return symbolsapi->maketoken(scanner.maketoken, tok->type,
+				 tok->text, tok->len, ptuple);
+  }
+  return PyObject_CallFunction(scanner.maketoken, "(i,N,O)", tok->type,
+			       PyString_FromStringAndSize(tok->text, tok->len),
+			       ptuple);
+}
+
+/*
+ * Call maketoken on a scanned token.
+ */
+static PyObject *
+maketoken_from(ScannedToken *tok)
+{
+  PyObject *token, *ptuple;
+  if (!scanner.maketoken) {
+    PyErr_SetString(PyExc_ValueError, "Not scanning anything");
+    return NULL;
   }
 				/* Set up the current position,
                                    including line position, file name,
-                                   and the list from above */
-  ptuple = Py_BuildValue("((i,i),(i,i),s,O)",
-			 scanner.pstack->pre_line, scanner.pstack->pre_col,
-			 scanner.pstack->cur_line, scanner.pstack->cur_col-1,
-			 scanner.pstack->filename, list);
-  Py_DECREF(list);
+                                   and the list from the context */
+#if FLEXMODULE_POSITIONS == FLEXMODULE_POS_NONE
+  Py_INCREF(Py_None);
+  ptuple = Py_None;
+#else
+  ptuple = Py_BuildValue("((" LINECOL_FORMAT "," LINECOL_FORMAT "),("
+			 LINECOL_FORMAT "," LINECOL_FORMAT "),OO)",
+			 tok->pre_line, tok->pre_col, tok->cur_line,
+#if FLEXMODULE_POSITIONS == FLEXMODULE_POS_LINECOL
+			 tok->cur_col - 1, /* The last column of the token */
+#else
+			 tok->cur_col,
+#endif
+			 PyTuple_GET_ITEM(tok->context, 0),
+			 PyTuple_GET_ITEM(tok->context, 1));
+  if (!ptuple) {
+    return NULL;
+  }
+#endif
 				/* Finally, call maketoken */
-  token = PyObject_CallFunction(scanner.maketoken, "(i,s#,O)",
-				scanner.lasttoken, yytext, yyleng, ptuple);
+#ifdef FLEXMODULE_STATS
+  if (scanstats.timing) {
+    double start = stats_clock();
+    token = calltoken(tok, ptuple);
+    scanstats.maketoken_time += stats_clock() - start;
+  } else
+#endif
+  token = calltoken(tok, ptuple);
   Py_DECREF(ptuple);
   return token;
 }
 
+/*
+ * Scan the next token from flex, advancing the position past it.
+ * Returns the token type, 0 at the end of the input, or -1 if a rule
+ * raised an exception (a failed PUSH_FILE, say) or a limit was passed.
+ */
+static int
+scan(void)
+{
+  int type = yylex();		/* Call flex for the next token */
+  if (PyErr_Occurred()) {
+    if (PyErr_ExceptionMatches(LimitExceeded)) {
+      closescan();		/* Too deep; give up the scan */
+    }
+    return -1;
+  }
+  if (!type) {			/* We're out of tokens */
+    return 0;
+  }
+  ADVANCE;			/* Automatically advance position */
+  FM_STAT(stats_token(type));
+  scanner.ntokens++;
+  if ((scanner.maxtokens || scanner.deadline) && scan_limits() < 0) {
+    closescan();
+    return -1;
+  }
+  return type;
+}
+
+/*
+ * Read the next token: the first one peeked at, if any, or else one
+ * from flex.  Returns as scan does; the token becomes the last token.
+ */
+static int
+readnext(void)
+{
+  tokenrecord r;
+  int type;
+  record_clear(&scanner.last);
+  if (scanner.ringcount) {	/* Swap the record into last */
+    r = scanner.last;
+    scanner.last = scanner.ring[scanner.ringhead];
+    scanner.ring[scanner.ringhead] = r;
+    scanner.ringhead = (scanner.ringhead + 1) % scanner.ringsize;
+    scanner.ringcount--;
+    scanner.lastlive = 0;
+    return scanner.lasttoken = scanner.last.tok.type;
+  }
+  scanner.lastlive = 1;
+  type = scan();
+  scanner.lasttoken = type > 0 ? type : 0;
+  return type;
+}
+
+/*
+ * Describe the last token read.
+ */
+static int
+lastscanned(ScannedToken *tok)
+{
+  if (scanner.lastlive) {
+    return scanned(tok);
+  }
+  *tok = scanner.last.tok;
+  return tok->type;
+}
+
+/*
+ * Return the token object for the last token read, calling maketoken
+ * the first time it is needed.  Returns a new reference.
+ */
+static PyObject *
+lastobject(void)
+{
+  ScannedToken tok;
+  if (!scanner.last.object) {
+    if (lastscanned(&tok) < 0) {
+      return NULL;
+    }
+    if (!(scanner.last.object = maketoken_from(&tok))) {
+      return NULL;
+    }
+  }
+  Py_INCREF(scanner.last.object);
+  return scanner.last.object;
+}
+
+/*
+ * Double the ring, which is full.
+ */
+static int
+growring(void)
+{
+  int n = scanner.ringsize ? scanner.ringsize * 2 : 8;
+  int i;
+  tokenrecord *ring = (tokenrecord *) pxmalloc(n * sizeof(tokenrecord));
+  if (!ring) {
+    return 0;
+  }
+  for (i = 0; i < scanner.ringsize; i++) {
+    ring[i] = scanner.ring[(scanner.ringhead + i) % scanner.ringsize];
+  }
+  memset(ring + scanner.ringsize, 0,
+	 (n - scanner.ringsize) * sizeof(tokenrecord));
+  free(scanner.ring);
+  scanner.ring = ring;
+  scanner.ringsize = n;
+  scanner.ringhead = 0;
+  return 1;
+}
+
+/*
+ * Scan ahead until n tokens are waiting or the input ends, and return
+ * the record of the n-th, or of the end of the input (type 0) if it
+ * comes first.  Returns NULL with an exception set on failure.
+ */
+static tokenrecord *
+peekat(int n)
+{
+  ScannedToken tok;
+  tokenrecord *r;
+  int type;
+  while (scanner.ringcount < n) {
+    if (scanner.ringcount
+	&& !scanner.ring[(scanner.ringhead + scanner.ringcount - 1)
+			 % scanner.ringsize].tok.type) {
+      break;			/* Already at the end */
+    }
+    if (scanner.lastlive) {	/* Copy the last token out of yytext
+				   before flex reuses it */
+      if (scanner.lasttoken
+	  && (scanned(&tok) < 0 || !record_set(&scanner.last, &tok))) {
+	return NULL;
+      }
+      scanner.lastlive = 0;
+    }
+    if (scanner.ringcount == scanner.ringsize && !growring()) {
+      return NULL;
+    }
+    if ((type = scanner.pstack ? scan() : 0) < 0) {
+      return NULL;
+    }
+    r = &scanner.ring[(scanner.ringhead + scanner.ringcount)
+		      % scanner.ringsize];
+    record_clear(r);
+    if (type) {
+      if (scanned(&tok) < 0) {
+	return NULL;
+      }
+      tok.type = type;
+      if (!record_set(r, &tok)) {
+	return NULL;
+      }
+    }
+    scanner.ringcount++;
+  }
+  return &scanner.ring[(scanner.ringhead
+			+ (n < scanner.ringcount ? n : scanner.ringcount) - 1)
+		       % scanner.ringsize];
+}
+
 /*
  * Python function to return the next token scanned and its type.
  * Has no parameters.
@@ -435,26 +1556,97 @@ maketoken(void)
 static PyObject *
 c_readtoken(PyObject * self, PyObject * args)
 {
-  PyObject *token, *value;
+  int type;
   if (!PyArg_ParseTuple(args, "")) { return NULL; }
   if (!scanning()) {
     PyErr_SetString(PyExc_ValueError, "Not scanning anything");
     return NULL;
   }
-  scanner.lasttoken = yylex();	/* Call flex for the next token */
-  if (!scanner.lasttoken) {	/* We're out of tokens; return None */
+  if ((type = readnext()) < 0) {
+    return NULL;
+  }
+  if (!type) {			/* We're out of tokens; return None */
     Py_INCREF(Py_None);
     return Py_None;
   }
-  ADVANCE;			/* Automatically advance position */
-  token = maketoken();		/* Call maketoken and build return pair */
-  value = Py_BuildValue("(i,O)", scanner.lasttoken, token);
-  Py_XDECREF(token);		/* maketoken may have failed */
-  return value;
+				/* Call maketoken and build return pair */
+  return Py_BuildValue("(i,N)", type, lastobject());
 }
 
 /*
- * Python function to return the most recent token scanned.
+ * Python function to look at the token n ahead without reading it.
+ * Parameter is n, 1 by default for the next token.
+ */
+static PyObject *
+c_peek(PyObject * self, PyObject * args)
+{
+  tokenrecord *r;
+  int n = 1;
+  if (!PyArg_ParseTuple(args, "|i", &n)) { return NULL; }
+  if (n < 1) {
+    PyErr_SetString(PyExc_ValueError, "Can only peek ahead");
+    return NULL;
+  }
+  if (!scanning()) {
+    PyErr_SetString(PyExc_ValueError, "Not scanning anything");
+    return NULL;
+  }
+  if (!(r = peekat(n))) {
+    return NULL;
+  }
+  if (!r->tok.type) {		/* The input ends first */
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  if (!r->object && !(r->object = maketoken_from(&r->tok))) {
+    return NULL;
+  }
+  return Py_BuildValue("(i,O)", r->tok.type, r->object);
+}
+
+/*
+ * Return the next pair from a Scanner, or NULL at the end of its scan
+ * (Python raises StopIteration if no other exception is set).
+ */
+static PyObject *
+scanner_iternext(PyObject *self)
+{
+  int type;
+  if (!scanning()
+      || ((ScannerObject *) self)->generation != scanner.generation) {
+    return NULL;
+  }
+  if ((type = readnext()) <= 0) {
+    return NULL;
+  }
+  return Py_BuildValue("(i,N)", type, lastobject());
+}
+
+/*
+ * The C interface, for BisonModule parsers: the next token as a
+ * ScannedToken, maketoken on request, and closing the scan.  See
+ * FlexModuleAPI.h.
+ */
+static int
+api_next(ScannedToken *tok)
+{
+  int type;
+  if (!scanning()) {
+    PyErr_SetString(PyExc_ValueError, "Not scanning anything");
+    return -1;
+  }
+  if ((type = readnext()) <= 0) {
+    return type;
+  }
+  return lastscanned(tok);
+}
+
+static ScannerAPI module_scannerapi = { api_next, maketoken_from,
+					closescan };
+
+/*
+ * Python function to return the most recent token read, as made by
+ * maketoken; it is only made once.
  * Has no parameters.
  */
 static PyObject *
@@ -465,7 +1657,133 @@ c_lasttoken(PyObject *self, PyObject *args)
     PyErr_SetString(PyExc_ValueError, "No token available");
     return NULL;
   }
-  return maketoken();		/* Call maketoken on the last info we had */
+  return lastobject();
+}
+
+#ifdef FLEXMODULE_STATS
+/*
+ * Insert a value into a statistics dictionary, taking over the
+ * reference.
+ */
+static void
+stats_item(PyObject *dict, char *name, PyObject *value)
+{
+  if (value) {
+    PyMapping_SetItemString(dict, name, value);
+    Py_DECREF(value);
+  }
+}
+#endif
+
+/*
+ * Python function to return the statistics gathered so far.
+ * Has no parameters.
+ */
+static PyObject *
+c_stats(PyObject *self, PyObject *args)
+{
+  PyObject *dict;
+  if (!PyArg_ParseTuple(args, "")) { return NULL; }
+  if (!(dict = PyDict_New())) { return NULL; }
+#ifdef FLEXMODULE_STATS
+  {
+    PyObject *types = PyDict_New();
+    int j;
+    for (j = 0; types && j < FLEXMODULE_STATS_TYPES; j++) {
+      if (scanstats.types[j]) {	/* Only the types actually seen */
+	PyObject *k = PyInt_FromLong(j), *v = PyInt_FromLong(scanstats.types[j]);
+	if (k && v) { PyDict_SetItem(types, k, v); }
+	Py_XDECREF(k);
+	Py_XDECREF(v);
+      }
+    }
+    stats_item(dict, "types", types);
+    stats_item(dict, "other_types", PyInt_FromLong(scanstats.othertypes));
+    stats_item(dict, "tokens", PyInt_FromLong(scanstats.tokens));
+    stats_item(dict, "bytes", PyLong_FromLongLong(scanstats.bytes));
+    stats_item(dict, "yywrap", PyInt_FromLong(scanstats.yywraps));
+    stats_item(dict, "max_depth", PyInt_FromLong(scanstats.maxdepth));
+    if (scanstats.timing) {
+      stats_item(dict, "maketoken_time",
+		 PyFloat_FromDouble(scanstats.maketoken_time));
+    }
+  }
+#endif
+  if (PyErr_Occurred()) {
+    Py_DECREF(dict);
+    return NULL;
+  }
+  return dict;
+}
+
+/*
+ * Python function to clear the statistics.
+ * Optional parameter: non-zero to time maketoken from now on, zero to
+ * stop; the default leaves timing as it was.
+ */
+static PyObject *
+c_reset_stats(PyObject *self, PyObject *args)
+{
+  int timing = scanstats.timing;
+  int depth = scanstats.depth;
+  if (!PyArg_ParseTuple(args, "|i", &timing)) { return NULL; }
+  memset(&scanstats, 0, sizeof(scanstats));
+  scanstats.timing = timing;
+  scanstats.depth = scanstats.maxdepth = depth; /* Still scanning at this depth */
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+/*
+ * Python function to return the rule profile: a dictionary mapping
+ * (file, line) of each rule to (matches, bytes).
+ * Has no parameters.
+ */
+static PyObject *
+c_profile(PyObject *self, PyObject *args)
+{
+  PyObject *dict;
+  int r;
+  if (!PyArg_ParseTuple(args, "")) { return NULL; }
+  if (!(dict = PyDict_New())) { return NULL; }
+  for (r = 1; r < ruleprofile.nrules; r++) {
+    PyObject *key = PyTuple_GET_ITEM(ruleprofile.rules, r);
+    PyObject *value, *old;
+    long matches = ruleprofile.matches[r];
+    long long bytes = ruleprofile.bytes[r];
+    if (!key) {
+      continue;
+    }
+				/* Rules sharing a line share an entry */
+    if ((old = PyDict_GetItem(dict, key))) {
+      matches += PyInt_AsLong(PyTuple_GET_ITEM(old, 0));
+      bytes += PyLong_AsLongLong(PyTuple_GET_ITEM(old, 1));
+    }
+    value = Py_BuildValue("(l,L)", matches, bytes);
+    if (!value || PyDict_SetItem(dict, key, value) < 0) {
+      Py_XDECREF(value);
+      Py_DECREF(dict);
+      return NULL;
+    }
+    Py_DECREF(value);
+  }
+  return dict;
+}
+
+/*
+ * Python function to clear the rule profile.
+ * Has no parameters.
+ */
+static PyObject *
+c_reset_profile(PyObject *self, PyObject *args)
+{
+  if (!PyArg_ParseTuple(args, "")) { return NULL; }
+  if (ruleprofile.nrules) {
+    memset(ruleprofile.matches, 0, ruleprofile.nrules * sizeof(long));
+    memset(ruleprofile.bytes, 0, ruleprofile.nrules * sizeof(long long));
+  }
+  Py_INCREF(Py_None);
+  return Py_None;
 }
 
 #define MAKETOKENDOC                                       \
@@ -480,26 +1798,53 @@ c_lasttoken(PyObject *self, PyObject *args)
 "- a list of tuples, giving the file name, line, and\n"    \
 "  column of stacked, yet-to-be finished positions."
 
+#define LIMITSDOC                                                \
+"deadline (a time.time() value), max_tokens and max_depth (of\n" \
+"PUSH_FILE includes), if non-zero, end the scan with\n"          \
+"LimitExceeded once one is passed."
+
 /*
  * Function table for scanner module.
  */
 static PyMethodDef module_methods[] = {
-  {"onstring", c_onstring, METH_VARARGS,
-   "onstring(maketoken, string) : begin scanning string\n" MAKETOKENDOC},
-  {"onfile", c_onfile, METH_VARARGS,
-   "onfile(maketoken, file) : begin scanning a file (name or object)\n"
-   MAKETOKENDOC},
+  {"onstring", (PyCFunction) c_onstring, METH_VARARGS | METH_KEYWORDS,
+   "onstring(maketoken, string[, deadline, max_tokens, max_depth]) :\n"
+   "    begin scanning string, returning an iterator over the tokens\n"
+   MAKETOKENDOC "\n" LIMITSDOC},
+  {"onfile", (PyCFunction) c_onfile, METH_VARARGS | METH_KEYWORDS,
+   "onfile(maketoken, file[, deadline, max_tokens, max_depth]) :\n"
+   "    begin scanning a file (name or object), returning an iterator\n"
+   "    over the tokens\n"
+   MAKETOKENDOC "\n" LIMITSDOC},
   {"readtoken", c_readtoken, METH_VARARGS,
    "readtoken() : read the next token, returning a pair of the token value\n"
    "              and the token returned by maketoken."},
   {"lasttoken", c_lasttoken, METH_VARARGS,
-   "lasttoken() : re-read the most-recent token"},
+   "lasttoken() : return the token object of the most-recent token"},
+  {"peek", c_peek, METH_VARARGS,
+   "peek([n]) : return the pair readtoken would return n tokens from\n"
+   "            now (1 by default) without reading them, or None if\n"
+   "            the input ends first"},
   {"close", c_close, METH_VARARGS,
-   "close() : free resources and stop scanning"},
+   "close() : stop scanning, keeping buffers for the next scan"},
+  {"release", c_release, METH_VARARGS,
+   "release() : free the buffers kept between scans"},
+  {"stats", c_stats, METH_VARARGS,
+   "stats() : return a dictionary of counters gathered since the last\n"
+   "          reset_stats(); empty unless built with FLEXMODULE_STATS"},
+  {"reset_stats", c_reset_stats, METH_VARARGS,
+   "reset_stats([timing]) : clear the counters; a true timing argument\n"
+   "                        also times calls to maketoken"},
+  {"profile", c_profile, METH_VARARGS,
+   "profile() : return {(file, line): (matches, bytes)} for each rule;\n"
+   "            empty unless built with FLEXMODULE_PROFILE"},
+  {"reset_profile", c_reset_profile, METH_VARARGS,
+   "reset_profile() : clear the rule profile"},
   {NULL, NULL, 0, 0}
 };
 
 #undef MAKETOKENDOC
+#undef LIMITSDOC
 
 /*
  * Type definition for table mapping token names to integer values.
@@ -538,6 +1883,26 @@ maketokens(TokenValues * toks, PyObject * module)
   Py_DECREF(names);
 }
 
+/*
+ * Set up the rule profile from flex's table of rule lines.
+ * FLEXMODULEINIT appears in the last section of the flex file, so
+ * __FILE__ names the specification itself.
+ */
+#ifdef FLEXMODULE_PROFILE
+#define FLEXMODULEPROFILE						\
+  do {									\
+    long lines[YY_NUM_RULES];						\
+    int r;								\
+    yy_flex_debug = 0;			/* No trace, just the table */	\
+    for (r = 0; r < YY_NUM_RULES; r++) {				\
+      lines[r] = yy_rule_linenum[r];					\
+    }									\
+    profile_init(__FILE__, lines, YY_NUM_RULES);			\
+  } while (0)
+#else
+#define FLEXMODULEPROFILE
+#endif
+
 /*
  * Macro called with module name and TokenValues mapping; handles
  * Python InitModule chores.  Note the fancy preprocessor
@@ -549,6 +1914,18 @@ init ## name (void) {							\
   PyObject *pmod = Py_InitModule4(#name, module_methods,		\
     "Flex-generated scanner module " #name, NULL, PYTHON_API_VERSION);	\
   maketokens(tokens, pmod);						\
+  import_symbols();							\
+  if (PyType_Ready(&ScannerType) == 0) {				\
+    Py_INCREF(&ScannerType);						\
+    PyModule_AddObject(pmod, "Scanner", (PyObject *) &ScannerType);	\
+  }									\
+  PyModule_AddObject(pmod, "scannerapi",				\
+    PyCapsule_New(&module_scannerapi, SCANNERAPI_CAPSULE, NULL));	\
+  LimitExceeded = PyErr_NewException(#name ".LimitExceeded",		\
+				     NULL, NULL);			\
+  Py_XINCREF(LimitExceeded);						\
+  PyModule_AddObject(pmod, "LimitExceeded", LimitExceeded);		\
+  FLEXMODULEPROFILE;							\
   if (PyErr_Occurred()) {						\
     Py_FatalError("Error initializing scanner module " #name);		\
   }									\
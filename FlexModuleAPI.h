@@ -0,0 +1,97 @@
+/*
+        FlexModuleAPI.h -- C interface between FlexModule scanners and
+                           BisonModule parsers
+
+        Copyright (c) 2002 by Tommy M. McGuire
+
+        Permission is hereby granted, free of charge, to any person
+        obtaining a copy of this software and associated documentation
+        files (the "Software"), to deal in the Software without
+        restriction, including without limitation the rights to use,
+        copy, modify, merge, publish, distribute, sublicense, and/or
+        sell copies of the Software, and to permit persons to whom
+        the Software is furnished to do so, subject to the following
+        conditions:
+
+        The above copyright notice and this permission notice shall be
+        included in all copies or substantial portions of the Software.
+
+        THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+        KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+        WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE
+        AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+        HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+        WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+        FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+        OTHER DEALINGS IN THE SOFTWARE.
+
+	Please report any problems to mcguire@cs.utexas.edu.
+
+	This is version 2.0.
+*/
+
+#ifndef FLEXMODULEAPI_H
+#define FLEXMODULEAPI_H
+
+#include "Python.h"
+
+/*
+ * A FlexModule scanner publishes a ScannerAPI in a capsule named
+ * "scannerapi" in its module.  Passing that capsule to a BisonModule
+ * parser in place of readtoken lets the parser pull tokens as plain C
+ * records and ask for the Python token object only if a grammar
+ * action keeps the token.
+ */
+#define SCANNERAPI_CAPSULE "FlexModule.scannerapi"
+
+/*
+ * Lines and columns are counted in 64 bits.  Positions given to Python
+ * hold them as ints where a C long is that wide (LP64 systems) and as
+ * longs elsewhere; LINECOL_FORMAT is the Py_BuildValue code for one.
+ */
+#if SIZEOF_LONG >= 8
+typedef long linecol;
+#define LINECOL_FORMAT "l"
+#else
+typedef PY_LONG_LONG linecol;
+#define LINECOL_FORMAT "L"
+#endif
+
+/*
+ * A scanned token, not (yet) a Python object.  The text belongs to
+ * the scanner and is only good until the next call to next().  The
+ * context is a tuple of the file name and the list of stacked
+ * positions, as passed to maketoken; it is borrowed, and a consumer
+ * holding on to the token must hold a reference to it.  The lines,
+ * columns and context are as the scanner's FLEXMODULE_POSITIONS
+ * profile keeps them (see FlexModule.h): columns are 0 with lines
+ * only, the columns are byte offsets and the lines 0 with offsets, and
+ * the context is None with no positions at all.
+ */
+typedef struct {
+  int type;			/* Token type, as returned by yylex */
+  const char *text;		/* Text of the token */
+  Py_ssize_t len;		/* Length of the text */
+  linecol pre_line;		/* Beginning line and column */
+  linecol pre_col;
+  linecol cur_line;		/* Line and column after the token */
+  linecol cur_col;
+  PyObject *context;		/* (filename, [stacked positions]) */
+} ScannedToken;
+
+typedef struct {
+				/* Scan the next token into tok;
+				   returns its type, 0 at the end of
+				   the input, or -1 with a Python
+				   exception set */
+  int (*next)(ScannedToken *tok);
+				/* Call the scanner's maketoken on a
+				   token; returns a new reference */
+  PyObject *(*maketoken)(ScannedToken *tok);
+				/* Stop scanning, as the module's
+				   close() does; for a parser that
+				   abandons its input */
+  void (*close)(void);
+} ScannerAPI;
+
+#endif /* FLEXMODULEAPI_H */
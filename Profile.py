@@ -0,0 +1,76 @@
+#  Profile -- Report Bison/FlexModule rule profiles
+#
+#        Copyright (c) 2002 by Tommy M. McGuire
+#
+#        Permission is hereby granted, free of charge, to any person
+#        obtaining a copy of this software and associated documentation
+#        files (the "Software"), to deal in the Software without
+#        restriction, including without limitation the rights to use,
+#        copy, modify, merge, publish, distribute, sublicense, and/or
+#        sell copies of the Software, and to permit persons to whom
+#        the Software is furnished to do so, subject to the following
+#        conditions:
+#
+#        The above copyright notice and this permission notice shall be
+#        included in all copies or substantial portions of the Software.
+#
+#        THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+#        KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+#        WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE
+#        AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+#        HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+#        WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+#        FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+#        OTHER DEALINGS IN THE SOFTWARE.
+#
+#	Please report any problems to mcguire@cs.utexas.edu.
+#
+#	This is version 2.0.
+
+import os
+
+def sourceline(file, line, directory=None, cache={}):
+    "Return the stripped text of a line of a .y or .l file, or ''."
+    if directory:
+	file = os.path.join(directory, os.path.basename(file))
+    if not cache.has_key(file):
+	try:
+	    cache[file] = open(file).readlines()
+	except IOError:
+	    cache[file] = []
+    lines = cache[file]
+    if 0 < line <= len(lines):
+	return " ".join(lines[line - 1].split())
+    return ""
+
+def table(profile, directory=None):
+    "Turn a module's profile() into a list of rows, most expensive "
+    "first.  Rows are (file, line, text, counts...), where the counts "
+    "are (reductions, seconds) for BisonModule and (matches, bytes) "
+    "for FlexModule.  Rule text is read from the grammar or scanner "
+    "file, looked up in directory if given."
+    rows = []
+    for (file, line), value in profile.items():
+	if len(value) == 3:		# BisonModule: (lhs, count, seconds)
+	    lhs, count, seconds = value
+	    text = sourceline(file, line, directory)
+	    if text[:1] == "|" or not text.startswith(lhs):
+		text = "%s: %s" % (lhs, text.lstrip("|").strip())
+	    rows.append((file, line, text, count, seconds))
+	else:				# FlexModule: (count, bytes)
+	    count, bytes = value
+	    text = line and sourceline(file, line, directory) or "(default)"
+	    rows.append((file, line, text, count, bytes))
+    rows.sort(lambda a, b: cmp(b[4], a[4]) or cmp(b[3], a[3]))
+    return rows
+
+def report(profile, directory=None, limit=None):
+    "Return a printable report of a profile."
+    out = []
+    for file, line, text, count, other in table(profile, directory)[:limit]:
+	if isinstance(other, float):
+	    other = "%10.6fs" % other
+	else:
+	    other = "%10dB" % other
+	out.append("%s:%-5d %10d %s  %s" % (file, line, count, other, text))
+    return "\n".join(out)
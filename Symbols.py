@@ -29,17 +29,27 @@
 
 def position(pos):
     "Return a string describing a token location."
-    # pos = ((line,col),(line,col),file,[(file,line,col)])
+    # pos = ((line,col),(line,col),file,[(file,line,col)]), or None
+    if pos is None:
+	return "no position"		# FLEXMODULE_POS_NONE
     begin, end, file, stack = pos
     if file == "-":
 	file = ""			# string
     else:
 	file = "file '%s', " % (file)	# file name
-    this = "%sline %d, col %d - line %d col %d" % \
-           (file, begin[0], begin[1], end[0], end[1])
+    if begin[0] == 0:			# FLEXMODULE_POS_OFFSETS
+	this = "%soffset %d - %d" % (file, begin[1], end[1])
+    elif begin[1] == 0:			# FLEXMODULE_POS_LINES
+	this = "%sline %d - line %d" % (file, begin[0], end[0])
+    else:
+	this = "%sline %d, col %d - line %d col %d" % \
+	       (file, begin[0], begin[1], end[0], end[1])
     if stack:
         for upfile, upline, upcol in stack:
-            this = this + "\n    from file '%s', line %d" % (upfile, upline)
+	    if upline == 0:
+		this = this + "\n    from file '%s', offset %d" % (upfile, upcol)
+	    else:
+		this = this + "\n    from file '%s', line %d" % (upfile, upline)
     return this
 
 class Symbol:
@@ -87,3 +97,122 @@ class Token(Symbol):
             self.string, kids)
     def location(self):
 	return "%s" % (position(self.position))
+
+class Factory:
+    "Make symbols or tokens of a class chosen by type: "
+    "Factory(classes, default)(type, ...) is "
+    "classes.get(type, default)(type, ...).  Pass one to FlexModule's "
+    "onstring or onfile, or BisonModule's parse."
+    def __init__(self, classes, default=None):
+	self.classes = classes
+	self.default = default
+    def __call__(self, type, *args):
+	cls = self.classes.get(type, self.default)
+	if cls is None:
+	    raise ValueError, "no class for type %d" % type
+	return cls(type, *args)
+
+def preorder(tree):
+    "Iterate over the nodes of a tree, parents before children, "
+    "without recursion.  Nodes without children are leaves."
+    stack = [tree]
+    while stack:
+	node = stack.pop()
+	yield node
+	kids = getattr(node, "children", None)
+	if kids:
+	    stack.extend(reversed(kids))
+
+def postorder(tree):
+    "Iterate over the nodes of a tree, children before parents, "
+    "without recursion."
+    stack = [[tree, 0]]
+    while stack:
+	frame = stack[-1]
+	kids = getattr(frame[0], "children", None) or ()
+	if frame[1] < len(kids):
+	    frame[1] = frame[1] + 1
+	    stack.append([kids[frame[1] - 1], 0])
+	else:
+	    stack.pop()
+	    yield frame[0]
+
+def flatten(tree):
+    "Return the tree in post-order as a list of (type, arity, node); "
+    "evaluate it by popping arity values for each node and pushing "
+    "its result.  The type of a leaf that is not a symbol is None."
+    return [(getattr(node, "type", None),
+	     len(getattr(node, "children", None) or ()), node)
+	    for node in postorder(tree)]
+
+					# Use the C types if they have
+					# been built; see cSymbols.c.
+					# The classes below have no
+					# instance dictionary, but
+					# subclasses of them do unless
+					# they set __slots__ too.
+try:
+    import cSymbols
+except ImportError:
+    cSymbols = None
+
+if cSymbols:
+    class Symbol(cSymbols.Symbol):
+	__doc__ = Symbol.__doc__
+	__slots__ = ()
+	names = {}
+
+    class Token(cSymbols.Token, Symbol):
+	__doc__ = Token.__doc__
+	__slots__ = ()
+	names = {}
+
+    Factory = cSymbols.Factory
+    preorder = cSymbols.preorder
+    postorder = cSymbols.postorder
+    flatten = cSymbols.flatten
+
+def export(tree, directory=None):
+    "Write a tree to a new file for load, and return the file's name. "
+    "A multiprocessing worker can hand back the name instead of the "
+    "tree.  The file goes in /dev/shm (shared memory) if there is one. "
+    "With cSymbols the tree is packed (see cSymbols.pack); without, "
+    "it is pickled."
+    import os, tempfile
+    if directory is None and os.path.isdir("/dev/shm"):
+	directory = "/dev/shm"
+    if cSymbols:
+	data = cSymbols.pack(tree)
+    else:
+	import cPickle
+	data = cPickle.dumps(tree, 2)
+    fd, name = tempfile.mkstemp(".tree", "symbols-", directory)
+    try:
+	while data:
+	    data = data[os.write(fd, data):]
+    finally:
+	os.close(fd)
+    return name
+
+def load(name, remove=1):
+    "Load a tree written by export, removing the file unless remove is "
+    "false.  A packed tree is not copied: the result is a "
+    "cSymbols.PackedTree over a mapping of the file, whose nodes "
+    "(tree.root and its children) are read out of it as they are "
+    "used, and tree.materialize(maketoken, makesymbol) makes the "
+    "Symbol and Token objects.  A pickled tree is simply unpickled."
+    import os, mmap
+    f = open(name, "rb")
+    try:
+	if cSymbols and f.read(8) == "cSymTre1":	# PACK_MAGIC
+	    tree = cSymbols.PackedTree(mmap.mmap(f.fileno(), 0,
+						 access=mmap.ACCESS_READ))
+	else:
+	    import cPickle
+	    f.seek(0)
+	    tree = cPickle.load(f)
+    finally:
+	f.close()
+	if remove:
+	    os.unlink(name)
+    return tree
@@ -0,0 +1,2219 @@
+/*
+        cSymbols.c -- C versions of the Symbol and Token classes
+
+        Copyright (c) 2002 by Tommy M. McGuire
+
+        Permission is hereby granted, free of charge, to any person
+        obtaining a copy of this software and associated documentation
+        files (the "Software"), to deal in the Software without
+        restriction, including without limitation the rights to use,
+        copy, modify, merge, publish, distribute, sublicense, and/or
+        sell copies of the Software, and to permit persons to whom
+        the Software is furnished to do so, subject to the following
+        conditions:
+
+        The above copyright notice and this permission notice shall be
+        included in all copies or substantial portions of the Software.
+
+        THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+        KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+        WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE
+        AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+        HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+        WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+        FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+        OTHER DEALINGS IN THE SOFTWARE.
+
+	Please report any problems to mcguire@cs.utexas.edu.
+
+	This is version 2.0.
+*/
+
+/*
+ * Parse trees are mostly Symbol and Token objects, so their size and
+ * the cost of making them matter.  The classes in Symbols.py keep
+ * their attributes in a dictionary per instance and run __init__,
+ * append and insert as Python code.  These types keep type, children,
+ * string and position in fixed slots, and FlexModule and BisonModule
+ * can make and link them without calling Python at all (see
+ * cSymbols.h).  Symbols.py uses them when this module can be
+ * imported; subclass Symbols.Symbol and Symbols.Token as before.
+ */
+
+#define CSYMBOLS_MODULE
+#include "Python.h"
+#include "structmember.h"
+#include <stdint.h>
+#include "cSymbols.h"
+#include "FlexModuleAPI.h"		/* For the position format */
+
+static PyTypeObject SymbolType;
+static PyTypeObject TokenType;
+static PyTypeObject FactoryType;
+
+static PyObject *appendname = NULL;	/* Interned "append" */
+static PyObject *insertname = NULL;	/* Interned "insert" */
+static PyObject *appenddescr = NULL;	/* Symbol.append itself */
+static PyObject *insertdescr = NULL;	/* Symbol.insert itself */
+
+/*
+ * Return the children list of a symbol, creating it if need be.
+ * Returns a borrowed reference.
+ */
+static PyObject *
+children(SymbolObject *self)
+{
+  if (!self->children) {
+    self->children = PyList_New(0);
+  }
+  return self->children;
+}
+
+/*
+ * Symbol(type, children, ...): extra arguments are ignored, as in
+ * Symbols.py.
+ */
+static int
+symbol_init(SymbolObject *self, PyObject *args, PyObject *kwds)
+{
+  PyObject *kids, *old;
+  int type;
+  if (PyTuple_GET_SIZE(args) > 2) {
+    args = PyTuple_GetSlice(args, 0, 2);
+  } else {
+    Py_INCREF(args);
+  }
+  if (!args || !PyArg_ParseTuple(args, "iO:Symbol", &type, &kids)) {
+    Py_XDECREF(args);
+    return -1;
+  }
+  Py_DECREF(args);
+  self->type = type;
+  old = self->children;
+  Py_INCREF(kids);
+  self->children = kids;
+  Py_XDECREF(old);
+  return 0;
+}
+
+/*
+ * Token(type, string, position)
+ */
+static int
+token_init(SymbolObject *self, PyObject *args, PyObject *kwds)
+{
+  PyObject *string, *position, *old;
+  int type;
+  if (!PyArg_ParseTuple(args, "iOO:Token", &type, &string, &position)) {
+    return -1;
+  }
+  self->type = type;
+  Py_INCREF(string);
+  old = self->string;
+  self->string = string;
+  Py_XDECREF(old);
+  Py_INCREF(position);
+  old = self->position;
+  self->position = position;
+  Py_XDECREF(old);
+  return 0;
+}
+
+static int
+symbol_traverse(SymbolObject *self, visitproc visit, void *arg)
+{
+  Py_VISIT(self->children);
+  Py_VISIT(self->string);
+  Py_VISIT(self->position);
+  return 0;
+}
+
+static int
+symbol_clear(SymbolObject *self)
+{
+  Py_CLEAR(self->children);
+  Py_CLEAR(self->string);
+  Py_CLEAR(self->position);
+  return 0;
+}
+
+/*
+ * Trees can be very deep; the trashcan keeps freeing them from
+ * running off the end of the C stack.
+ */
+static void
+symbol_dealloc(SymbolObject *self)
+{
+  PyObject_GC_UnTrack(self);
+  Py_TRASHCAN_SAFE_BEGIN(self)
+  symbol_clear(self);
+  Py_TYPE(self)->tp_free((PyObject *) self);
+  Py_TRASHCAN_SAFE_END(self)
+}
+
+static PyObject *
+symbol_append(SymbolObject *self, PyObject *object)
+{
+  if (!children(self) || PyList_Append(self->children, object) < 0) {
+    return NULL;
+  }
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyObject *
+symbol_insert(SymbolObject *self, PyObject *args)
+{
+  PyObject *object;
+  Py_ssize_t idx;
+  if (!PyArg_ParseTuple(args, "nO:insert", &idx, &object)) {
+    return NULL;
+  }
+  if (!children(self) || PyList_Insert(self->children, idx, object) < 0) {
+    return NULL;
+  }
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+/*
+ * Format a position, as Symbols.position does.  A line of 0 marks byte
+ * offsets and a column of 0 lines alone (see FlexModule's position
+ * profiles).
+ */
+static PyObject *
+format_position(PyObject *pos)
+{
+  PyObject *file, *stack, *args, *fmt, *result;
+  PY_LONG_LONG bline, bcol, eline, ecol;
+  Py_ssize_t i, n;
+  if (!PyArg_ParseTuple(pos, "(LL)(LL)OO:position", &bline, &bcol,
+			&eline, &ecol, &file, &stack)) {
+    return NULL;
+  }
+  if (PyString_Check(file) && !strcmp(PyString_AS_STRING(file), "-")) {
+    file = PyString_FromString("");
+  } else {
+    PyObject *name = PyObject_Str(file);
+    file = name ? PyString_FromFormat("file '%s', ", PyString_AS_STRING(name))
+      : NULL;
+    Py_XDECREF(name);
+  }
+  if (!bline) {			/* Offsets */
+    fmt = PyString_FromString("%soffset %d - %d");
+    args = Py_BuildValue("(NLL)", file, bcol, ecol);
+  } else if (!bcol) {		/* Lines */
+    fmt = PyString_FromString("%sline %d - line %d");
+    args = Py_BuildValue("(NLL)", file, bline, eline);
+  } else {
+    fmt = PyString_FromString("%sline %d, col %d - line %d col %d");
+    args = Py_BuildValue("(NLLLL)", file, bline, bcol, eline, ecol);
+  }
+  result = fmt && args ? PyString_Format(fmt, args) : NULL;
+  Py_XDECREF(fmt);
+  Py_XDECREF(args);
+				/* Add the stacked positions */
+  if (result && PyObject_IsTrue(stack) > 0) {
+    PyObject *linefmt, *offsetfmt;
+    if (!(stack = PySequence_Fast(stack, "position stack"))) {
+      Py_DECREF(result);
+      return NULL;
+    }
+    linefmt = PyString_FromString("\n    from file '%s', line %d");
+    offsetfmt = PyString_FromString("\n    from file '%s', offset %d");
+    n = PySequence_Fast_GET_SIZE(stack);
+    for (i = 0; result && linefmt && offsetfmt && i < n; i++) {
+      PyObject *item = PySequence_Tuple(PySequence_Fast_GET_ITEM(stack, i));
+      PyObject *upfile, *upline, *upcol, *line = NULL;
+      if (item && PyArg_ParseTuple(item, "OOO:position stack", &upfile,
+				   &upline, &upcol)) {
+	args = PyObject_IsTrue(upline)
+	  ? Py_BuildValue("(OO)", upfile, upline)
+	  : Py_BuildValue("(OO)", upfile, upcol);
+	line = args ? PyString_Format(PyObject_IsTrue(upline)
+				      ? linefmt : offsetfmt, args) : NULL;
+	Py_XDECREF(args);
+      }
+      Py_XDECREF(item);
+      PyString_ConcatAndDel(&result, line);
+    }
+    if (!linefmt || !offsetfmt) {
+      Py_CLEAR(result);
+    }
+    Py_XDECREF(linefmt);
+    Py_XDECREF(offsetfmt);
+    Py_DECREF(stack);
+  }
+  return result;
+}
+
+static PyObject *
+c_position(PyObject *self, PyObject *pos)
+{
+  if (pos == Py_None) {		/* FLEXMODULE_POS_NONE */
+    return PyString_FromString("no position");
+  }
+  if (!PyTuple_Check(pos)) {
+    PyErr_SetString(PyExc_TypeError, "position must be a tuple");
+    return NULL;
+  }
+  return format_position(pos);
+}
+
+static PyObject *
+token_location(SymbolObject *self)
+{
+  if (!self->position) {
+    PyErr_SetString(PyExc_AttributeError, "position");
+    return NULL;
+  }
+  return c_position(NULL, self->position);
+}
+
+/*
+ * The pieces of __str__: the name of the class, the name of the type
+ * from the class's names dictionary (or dflt if it has none), and the
+ * children, or "" if there are none.
+ */
+static PyObject *
+str_parts(SymbolObject *self, PyObject *dflt)
+{
+  PyObject *names, *key, *name = NULL, *kids, *strs;
+  const char *cls = strrchr(Py_TYPE(self)->tp_name, '.');
+  Py_ssize_t i, n;
+  cls = cls ? cls + 1 : Py_TYPE(self)->tp_name;
+  if (!(names = PyObject_GetAttrString((PyObject *) self, "names"))) {
+    return NULL;
+  }
+  if ((key = PyInt_FromLong(self->type))) {
+    name = PyObject_GetItem(names, key);
+    Py_DECREF(key);
+  }
+  Py_DECREF(names);
+  if (!name) {
+    if (!PyErr_ExceptionMatches(PyExc_KeyError)) {
+      return NULL;
+    }
+    PyErr_Clear();
+    Py_INCREF(dflt);
+    name = dflt;
+  }
+  if (self->children && PyObject_IsTrue(self->children) > 0) {
+    PyObject *sep = PyString_FromString(" ");
+    PyObject *seq = PySequence_Fast(self->children, "children");
+    n = seq ? PySequence_Fast_GET_SIZE(seq) : 0;
+    strs = seq ? PyList_New(n) : NULL;
+    for (i = 0; strs && i < n; i++) {
+      PyObject *s = PyObject_Str(PySequence_Fast_GET_ITEM(seq, i));
+      if (!s) {
+	Py_CLEAR(strs);
+	break;
+      }
+      PyList_SET_ITEM(strs, i, s);
+    }
+    kids = sep && strs ? _PyString_Join(sep, strs) : NULL;
+    if (kids) {
+      PyObject *k = PyString_FromFormat(" (%s)", PyString_AS_STRING(kids));
+      Py_DECREF(kids);
+      kids = k;
+    }
+    Py_XDECREF(sep);
+    Py_XDECREF(seq);
+    Py_XDECREF(strs);
+  } else {
+    kids = PyString_FromString("");
+  }
+  if (!kids) {
+    Py_DECREF(name);
+    return NULL;
+  }
+  return Py_BuildValue("(sNiN)", cls, name, self->type, kids);
+}
+
+/*
+ * Apply a format to a tuple, releasing the tuple.
+ */
+static PyObject *
+format(const char *fmt, PyObject *args)
+{
+  PyObject *f, *result = NULL;
+  if (args && (f = PyString_FromString(fmt))) {
+    result = PyString_Format(f, args);
+    Py_DECREF(f);
+  }
+  Py_XDECREF(args);
+  return result;
+}
+
+static PyObject *
+symbol_str(SymbolObject *self)
+{
+  PyObject *unnamed = PyString_FromString("unnamed"), *parts;
+  if (!unnamed) {
+    return NULL;
+  }
+  parts = str_parts(self, unnamed);
+  Py_DECREF(unnamed);
+  return format("(%s %s (%d)%s)", parts);
+}
+
+static PyObject *
+token_str(SymbolObject *self)
+{
+  PyObject *quoted, *parts, *location, *args;
+  if (!self->string) {
+    PyErr_SetString(PyExc_AttributeError, "string");
+    return NULL;
+  }
+  if (!(quoted = format("'%s'", PyTuple_Pack(1, self->string)))) {
+    return NULL;
+  }
+  parts = str_parts(self, quoted);
+  Py_DECREF(quoted);
+  if (!parts) {
+    return NULL;
+  }
+  location = PyObject_CallMethod((PyObject *) self, "location", NULL);
+  if (!location) {
+    Py_DECREF(parts);
+    return NULL;
+  }
+  args = Py_BuildValue("(OOONOO)", PyTuple_GET_ITEM(parts, 0),
+		       PyTuple_GET_ITEM(parts, 1), PyTuple_GET_ITEM(parts, 2),
+		       location, self->string, PyTuple_GET_ITEM(parts, 3));
+  Py_DECREF(parts);
+  return format("(%s %s (%d) [%s] %s%s)", args);
+}
+
+/*
+ * Pickling and copying: the slots and any instance dictionary are
+ * the state; __init__ is not run again, as with classic instances.
+ */
+static PyObject *
+symbol_reduce(SymbolObject *self)
+{
+  static PyObject *newobj = NULL;
+  PyObject *dict;
+  if (!newobj) {
+    PyObject *copyreg = PyImport_ImportModule("copy_reg");
+    if (!copyreg) {
+      return NULL;
+    }
+    newobj = PyObject_GetAttrString(copyreg, "__newobj__");
+    Py_DECREF(copyreg);
+    if (!newobj) {
+      return NULL;
+    }
+  }
+  if (!(dict = PyObject_GetAttrString((PyObject *) self, "__dict__"))) {
+    PyErr_Clear();
+    Py_INCREF(Py_None);
+    dict = Py_None;
+  }
+  return Py_BuildValue("(O(O)(iOOON))", newobj, Py_TYPE(self), self->type,
+		       self->children ? self->children : Py_None,
+		       self->string ? self->string : Py_None,
+		       self->position ? self->position : Py_None, dict);
+}
+
+static PyObject *
+symbol_setstate(SymbolObject *self, PyObject *state)
+{
+  PyObject *kids, *string, *position, *dict;
+  int type;
+  if (!PyArg_ParseTuple(state, "iOOOO:__setstate__", &type, &kids,
+			&string, &position, &dict)) {
+    return NULL;
+  }
+  self->type = type;
+  symbol_clear(self);
+  if (kids != Py_None) {
+    Py_INCREF(kids);
+    self->children = kids;
+  }
+  if (string != Py_None) {
+    Py_INCREF(string);
+    self->string = string;
+  }
+  if (position != Py_None) {
+    Py_INCREF(position);
+    self->position = position;
+  }
+  if (dict != Py_None) {
+    PyObject *mine = PyObject_GetAttrString((PyObject *) self, "__dict__");
+    if (!mine || PyDict_Update(mine, dict) < 0) {
+      Py_XDECREF(mine);
+      return NULL;
+    }
+    Py_DECREF(mine);
+  }
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyObject *
+symbol_getchildren(SymbolObject *self, void *closure)
+{
+  PyObject *kids = children(self);
+  Py_XINCREF(kids);
+  return kids;
+}
+
+static int
+symbol_setchildren(SymbolObject *self, PyObject *value, void *closure)
+{
+  PyObject *old = self->children;
+  if (!value) {
+    PyErr_SetString(PyExc_TypeError, "can't delete children");
+    return -1;
+  }
+  Py_INCREF(value);
+  self->children = value;
+  Py_XDECREF(old);
+  return 0;
+}
+
+static PyMethodDef symbol_methods[] = {
+  {"append", (PyCFunction) symbol_append, METH_O,
+   "append(object) : add object to the end of the children"},
+  {"insert", (PyCFunction) symbol_insert, METH_VARARGS,
+   "insert(index, object) : insert object into the children"},
+  {"__reduce__", (PyCFunction) symbol_reduce, METH_NOARGS, NULL},
+  {"__setstate__", (PyCFunction) symbol_setstate, METH_O, NULL},
+  {NULL, NULL, 0, NULL}
+};
+
+static PyMethodDef token_methods[] = {
+  {"location", (PyCFunction) token_location, METH_NOARGS,
+   "location() : describe the position of the token"},
+  {NULL, NULL, 0, NULL}
+};
+
+static PyMemberDef symbol_members[] = {
+  {"type", T_INT, offsetof(SymbolObject, type), 0, "symbol type"},
+  {NULL, 0, 0, 0, NULL}
+};
+
+static PyMemberDef token_members[] = {
+  {"string", T_OBJECT_EX, offsetof(SymbolObject, string), 0, "token text"},
+  {"position", T_OBJECT_EX, offsetof(SymbolObject, position), 0,
+   "token position"},
+  {NULL, 0, 0, 0, NULL}
+};
+
+static PyGetSetDef symbol_getset[] = {
+  {"children", (getter) symbol_getchildren, (setter) symbol_setchildren,
+   "list of children", NULL},
+  {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyTypeObject SymbolType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "cSymbols.Symbol",		/* tp_name */
+  sizeof(SymbolObject),		/* tp_basicsize */
+  0,				/* tp_itemsize */
+  (destructor) symbol_dealloc,	/* tp_dealloc */
+  0,				/* tp_print */
+  0,				/* tp_getattr */
+  0,				/* tp_setattr */
+  0,				/* tp_compare */
+  0,				/* tp_repr */
+  0,				/* tp_as_number */
+  0,				/* tp_as_sequence */
+  0,				/* tp_as_mapping */
+  0,				/* tp_hash */
+  0,				/* tp_call */
+  (reprfunc) symbol_str,	/* tp_str */
+  0,				/* tp_getattro */
+  0,				/* tp_setattro */
+  0,				/* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+  "Symbol(type, children) : a non-terminal grammar symbol",
+  (traverseproc) symbol_traverse, /* tp_traverse */
+  (inquiry) symbol_clear,	/* tp_clear */
+  0,				/* tp_richcompare */
+  0,				/* tp_weaklistoffset */
+  0,				/* tp_iter */
+  0,				/* tp_iternext */
+  symbol_methods,		/* tp_methods */
+  symbol_members,		/* tp_members */
+  symbol_getset,		/* tp_getset */
+  0,				/* tp_base */
+  0,				/* tp_dict */
+  0,				/* tp_descr_get */
+  0,				/* tp_descr_set */
+  0,				/* tp_dictoffset */
+  (initproc) symbol_init,	/* tp_init */
+  0,				/* tp_alloc */
+  PyType_GenericNew,		/* tp_new */
+};
+
+static PyTypeObject TokenType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "cSymbols.Token",		/* tp_name */
+  sizeof(SymbolObject),		/* tp_basicsize */
+  0,				/* tp_itemsize */
+  (destructor) symbol_dealloc,	/* tp_dealloc */
+  0,				/* tp_print */
+  0,				/* tp_getattr */
+  0,				/* tp_setattr */
+  0,				/* tp_compare */
+  0,				/* tp_repr */
+  0,				/* tp_as_number */
+  0,				/* tp_as_sequence */
+  0,				/* tp_as_mapping */
+  0,				/* tp_hash */
+  0,				/* tp_call */
+  (reprfunc) token_str,		/* tp_str */
+  0,				/* tp_getattro */
+  0,				/* tp_setattro */
+  0,				/* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+  "Token(type, string, position) : a terminal symbol from the scanner",
+  (traverseproc) symbol_traverse, /* tp_traverse */
+  (inquiry) symbol_clear,	/* tp_clear */
+  0,				/* tp_richcompare */
+  0,				/* tp_weaklistoffset */
+  0,				/* tp_iter */
+  0,				/* tp_iternext */
+  token_methods,		/* tp_methods */
+  token_members,		/* tp_members */
+  0,				/* tp_getset */
+  &SymbolType,			/* tp_base */
+  0,				/* tp_dict */
+  0,				/* tp_descr_get */
+  0,				/* tp_descr_set */
+  0,				/* tp_dictoffset */
+  (initproc) token_init,	/* tp_init */
+  0,				/* tp_alloc */
+  PyType_GenericNew,		/* tp_new */
+};
+
+/*
+ * A Factory maps types to classes, for use as maketoken and
+ * makesymbol: Factory(classes, default)(type, ...) is
+ * classes.get(type, default)(type, ...).  Given a Factory, FlexModule
+ * and BisonModule pick the class themselves and, if it is one of the
+ * types here or a subclass without an __init__ of its own, fill in
+ * the new object directly.
+ */
+typedef struct {
+  PyObject_HEAD
+  PyObject *classes;		/* Dictionary of type to class */
+  PyObject *dflt;		/* Class for other types, or None */
+} FactoryObject;
+
+static int
+factory_init(FactoryObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"classes", "default", NULL};
+  PyObject *classes, *dflt = Py_None;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|O:Factory", kwlist,
+				   &PyDict_Type, &classes, &dflt)) {
+    return -1;
+  }
+  Py_INCREF(classes);
+  Py_INCREF(dflt);
+  Py_CLEAR(self->classes);
+  Py_CLEAR(self->dflt);
+  self->classes = classes;
+  self->dflt = dflt;
+  return 0;
+}
+
+static int
+factory_traverse(FactoryObject *self, visitproc visit, void *arg)
+{
+  Py_VISIT(self->classes);
+  Py_VISIT(self->dflt);
+  return 0;
+}
+
+static int
+factory_clear(FactoryObject *self)
+{
+  Py_CLEAR(self->classes);
+  Py_CLEAR(self->dflt);
+  return 0;
+}
+
+static void
+factory_dealloc(FactoryObject *self)
+{
+  PyObject_GC_UnTrack(self);
+  factory_clear(self);
+  Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+/*
+ * Return the class a factory makes for a type (borrowed), or NULL
+ * with an exception set.
+ */
+static PyObject *
+factory_class(FactoryObject *self, int type)
+{
+  PyObject *key, *cls = NULL;
+  if (self->classes && (key = PyInt_FromLong(type))) {
+    cls = PyDict_GetItem(self->classes, key);
+    Py_DECREF(key);
+  }
+  if (!cls) {
+    cls = self->dflt;
+  }
+  if (!cls || cls == Py_None) {
+    PyErr_Format(PyExc_ValueError, "no class for type %d", type);
+    return NULL;
+  }
+  return cls;
+}
+
+static PyObject *
+factory_call(FactoryObject *self, PyObject *args, PyObject *kwds)
+{
+  PyObject *cls;
+  int type;
+  if (PyTuple_GET_SIZE(args) < 1) {
+    PyErr_SetString(PyExc_TypeError, "Factory needs a type");
+    return NULL;
+  }
+  type = (int) PyInt_AsLong(PyTuple_GET_ITEM(args, 0));
+  if (PyErr_Occurred() || !(cls = factory_class(self, type))) {
+    return NULL;
+  }
+  return PyObject_Call(cls, args, kwds);
+}
+
+static PyMemberDef factory_members[] = {
+  {"classes", T_OBJECT, offsetof(FactoryObject, classes), READONLY,
+   "dictionary of type to class"},
+  {"default", T_OBJECT, offsetof(FactoryObject, dflt), READONLY,
+   "class for types not in classes"},
+  {NULL, 0, 0, 0, NULL}
+};
+
+static PyTypeObject FactoryType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "cSymbols.Factory",		/* tp_name */
+  sizeof(FactoryObject),	/* tp_basicsize */
+  0,				/* tp_itemsize */
+  (destructor) factory_dealloc,	/* tp_dealloc */
+  0,				/* tp_print */
+  0,				/* tp_getattr */
+  0,				/* tp_setattr */
+  0,				/* tp_compare */
+  0,				/* tp_repr */
+  0,				/* tp_as_number */
+  0,				/* tp_as_sequence */
+  0,				/* tp_as_mapping */
+  0,				/* tp_hash */
+  (ternaryfunc) factory_call,	/* tp_call */
+  0,				/* tp_str */
+  0,				/* tp_getattro */
+  0,				/* tp_setattro */
+  0,				/* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+  "Factory(classes[, default]) : make symbols or tokens of the class\n"
+  "                              chosen by their type",
+  (traverseproc) factory_traverse, /* tp_traverse */
+  (inquiry) factory_clear,	/* tp_clear */
+  0,				/* tp_richcompare */
+  0,				/* tp_weaklistoffset */
+  0,				/* tp_iter */
+  0,				/* tp_iternext */
+  0,				/* tp_methods */
+  factory_members,		/* tp_members */
+  0,				/* tp_getset */
+  0,				/* tp_base */
+  0,				/* tp_dict */
+  0,				/* tp_descr_get */
+  0,				/* tp_descr_set */
+  0,				/* tp_dictoffset */
+  (initproc) factory_init,	/* tp_init */
+  0,				/* tp_alloc */
+  PyType_GenericNew,		/* tp_new */
+};
+
+/*
+ * Tree traversal.
+ *
+ * Walking a tree by recursing over children in Python is slow and
+ * runs into the recursion limit on deep trees (long assignment
+ * chains, say).  These iterators keep their own stack instead.  Any
+ * object with a children sequence is an interior node; anything else
+ * (a token with no children, the message string of a syntax error) is
+ * a leaf.  The tree must not contain cycles.
+ */
+typedef struct {
+  PyObject *node;		/* Node at this level */
+  PyObject *kids;		/* Its children, from PySequence_Fast */
+  Py_ssize_t next;		/* Index of the next child to visit */
+} treeframe;
+
+typedef struct {
+  PyObject_HEAD
+  PyObject *root;		/* Not yet visited, or NULL */
+  int postorder;		/* Children before their parent? */
+  treeframe *stack;		/* Nodes being visited */
+  Py_ssize_t depth;		/* Frames in use */
+  Py_ssize_t size;		/* Frames allocated */
+} TreeIterObject;
+
+static PyTypeObject TreeIterType;
+
+/*
+ * Return the children of a node as a fast sequence (a new reference),
+ * or NULL for a leaf.  NULL with an exception set is an error.
+ */
+static PyObject *
+node_children(PyObject *node)
+{
+  PyObject *kids;
+  if (PyObject_TypeCheck(node, &SymbolType)) {
+    kids = ((SymbolObject *) node)->children;
+    Py_XINCREF(kids);
+  } else if (PyString_Check(node) || PyInt_Check(node)
+	     || PyFloat_Check(node) || node == Py_None) {
+    return NULL;
+  } else if (!(kids = PyObject_GetAttrString(node, "children"))) {
+    if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
+      PyErr_Clear();
+    }
+    return NULL;
+  }
+  if (!kids || kids == Py_None || PyList_CheckExact(kids)
+      || PyTuple_CheckExact(kids)) {
+    if (kids == Py_None) {
+      Py_CLEAR(kids);
+    }
+    return kids;
+  }
+  node = PySequence_Fast(kids, "children must be a sequence");
+  Py_DECREF(kids);
+  return node;
+}
+
+/*
+ * Return the type of a node, or None.
+ */
+static PyObject *
+node_type(PyObject *node)
+{
+  PyObject *type;
+  if (PyObject_TypeCheck(node, &SymbolType)) {
+    return PyInt_FromLong(((SymbolObject *) node)->type);
+  }
+  if (PyString_Check(node) || !(type = PyObject_GetAttrString(node, "type"))) {
+    PyErr_Clear();
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  return type;
+}
+
+/*
+ * Push a node onto an iterator's stack.
+ */
+static int
+treeiter_push(TreeIterObject *it, PyObject *node)
+{
+  treeframe *f;
+  PyObject *kids = node_children(node);
+  if (!kids && PyErr_Occurred()) {
+    return -1;
+  }
+  if (it->depth >= it->size) {
+    Py_ssize_t n = it->size ? it->size * 2 : 64;
+    treeframe *stack = PyMem_Realloc(it->stack, n * sizeof(treeframe));
+    if (!stack) {
+      Py_XDECREF(kids);
+      PyErr_NoMemory();
+      return -1;
+    }
+    it->stack = stack;
+    it->size = n;
+  }
+  f = &it->stack[it->depth++];
+  Py_INCREF(node);
+  f->node = node;
+  f->kids = kids;
+  f->next = 0;
+  return 0;
+}
+
+static PyObject *
+treeiter_next(TreeIterObject *it)
+{
+  treeframe *f;
+  PyObject *node;
+  if (it->root) {		/* First call */
+    node = it->root;
+    it->root = NULL;
+    if (treeiter_push(it, node) < 0) {
+      Py_DECREF(node);
+      return NULL;
+    }
+    if (!it->postorder) {
+      return node;
+    }
+    Py_DECREF(node);
+  }
+  while (it->depth > 0) {
+    f = &it->stack[it->depth - 1];
+    if (f->kids && f->next < PySequence_Fast_GET_SIZE(f->kids)) {
+				/* Down to the next child */
+      node = PySequence_Fast_GET_ITEM(f->kids, f->next);
+      f->next++;
+      if (treeiter_push(it, node) < 0) {
+	return NULL;
+      }
+      if (!it->postorder) {
+	Py_INCREF(node);
+	return node;
+      }
+    } else {			/* Done with this node; back up */
+      it->depth--;
+      Py_XDECREF(f->kids);
+      if (it->postorder) {
+	return f->node;
+      }
+      Py_DECREF(f->node);
+    }
+  }
+  return NULL;
+}
+
+static int
+treeiter_traverse(TreeIterObject *it, visitproc visit, void *arg)
+{
+  Py_ssize_t i;
+  Py_VISIT(it->root);
+  for (i = 0; i < it->depth; i++) {
+    Py_VISIT(it->stack[i].node);
+    Py_VISIT(it->stack[i].kids);
+  }
+  return 0;
+}
+
+static int
+treeiter_clear(TreeIterObject *it)
+{
+  Py_CLEAR(it->root);
+  while (it->depth > 0) {
+    it->depth--;
+    Py_CLEAR(it->stack[it->depth].node);
+    Py_CLEAR(it->stack[it->depth].kids);
+  }
+  return 0;
+}
+
+static void
+treeiter_dealloc(TreeIterObject *it)
+{
+  PyObject_GC_UnTrack(it);
+  treeiter_clear(it);
+  PyMem_Free(it->stack);
+  PyObject_GC_Del(it);
+}
+
+static PyTypeObject TreeIterType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "cSymbols.TreeIterator",	/* tp_name */
+  sizeof(TreeIterObject),	/* tp_basicsize */
+  0,				/* tp_itemsize */
+  (destructor) treeiter_dealloc, /* tp_dealloc */
+  0,				/* tp_print */
+  0,				/* tp_getattr */
+  0,				/* tp_setattr */
+  0,				/* tp_compare */
+  0,				/* tp_repr */
+  0,				/* tp_as_number */
+  0,				/* tp_as_sequence */
+  0,				/* tp_as_mapping */
+  0,				/* tp_hash */
+  0,				/* tp_call */
+  0,				/* tp_str */
+  0,				/* tp_getattro */
+  0,				/* tp_setattro */
+  0,				/* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+  "Iterator over the nodes of a tree",
+  (traverseproc) treeiter_traverse, /* tp_traverse */
+  (inquiry) treeiter_clear,	/* tp_clear */
+  0,				/* tp_richcompare */
+  0,				/* tp_weaklistoffset */
+  PyObject_SelfIter,		/* tp_iter */
+  (iternextfunc) treeiter_next,	/* tp_iternext */
+};
+
+static PyObject *
+treeiter_new(PyObject *root, int postorder)
+{
+  TreeIterObject *it = PyObject_GC_New(TreeIterObject, &TreeIterType);
+  if (!it) {
+    return NULL;
+  }
+  Py_INCREF(root);
+  it->root = root;
+  it->postorder = postorder;
+  it->stack = NULL;
+  it->depth = it->size = 0;
+  PyObject_GC_Track(it);
+  return (PyObject *) it;
+}
+
+static PyObject *
+c_preorder(PyObject *self, PyObject *root)
+{
+  return treeiter_new(root, 0);
+}
+
+static PyObject *
+c_postorder(PyObject *self, PyObject *root)
+{
+  return treeiter_new(root, 1);
+}
+
+/*
+ * Return the tree in post-order as a list of (type, arity, node):
+ * evaluate it by running down the list with a stack, popping arity
+ * values for each node and pushing its result.
+ */
+static PyObject *
+c_flatten(PyObject *self, PyObject *root)
+{
+  PyObject *list, *node, *rec;
+  TreeIterObject *it;
+  if (!(list = PyList_New(0))) {
+    return NULL;
+  }
+  if (!(it = (TreeIterObject *) treeiter_new(root, 1))) {
+    Py_DECREF(list);
+    return NULL;
+  }
+  while ((node = treeiter_next(it))) {
+				/* The frame just popped counted the
+				   children visited */
+    rec = Py_BuildValue("(NnN)", node_type(node), it->stack[it->depth].next,
+			node);
+    if (!rec || PyList_Append(list, rec) < 0) {
+      Py_XDECREF(rec);
+      break;
+    }
+    Py_DECREF(rec);
+  }
+  Py_DECREF(it);
+  if (PyErr_Occurred()) {
+    Py_DECREF(list);
+    return NULL;
+  }
+  return list;
+}
+
+/*
+ * The C interface.
+ *
+ * Pick the class a maker would use, if it can be known without
+ * calling it: the maker itself, if it is a class, or the class a
+ * Factory chooses.  Returns a borrowed reference, NULL with an
+ * exception set, or NULL with no exception if the maker has to be
+ * called.
+ */
+static PyObject *
+api_class(PyObject *maker, int type)
+{
+  if (Py_TYPE(maker) == &FactoryType) {
+    return factory_class((FactoryObject *) maker, type);
+  }
+  if (PyType_Check(maker)) {
+    return maker;
+  }
+  return NULL;
+}
+
+/*
+ * Allocate a node of a class, if the class is one of ours and its
+ * __init__ is ours too (so skipping it changes nothing).
+ */
+static SymbolObject *
+api_alloc(PyObject *cls, initproc init)
+{
+  PyTypeObject *type = (PyTypeObject *) cls;
+  if (!PyType_IsSubtype(type, &SymbolType) || type->tp_init != init
+      || type->tp_new != PyType_GenericNew) {
+    return NULL;
+  }
+  return (SymbolObject *) type->tp_alloc(type, 0);
+}
+
+static PyObject *
+api_makesymbol(PyObject *maker, int type, PyObject *kids)
+{
+  PyObject *cls = api_class(maker, type);
+  SymbolObject *ob;
+  if (!cls) {
+    if (PyErr_Occurred()) {
+      return NULL;
+    }
+    return PyObject_CallFunction(maker, "iO", type, kids);
+  }
+  if (!(ob = api_alloc(cls, (initproc) symbol_init))) {
+    if (PyErr_Occurred()) {
+      return NULL;
+    }
+    return PyObject_CallFunction(cls, "iO", type, kids);
+  }
+  ob->type = type;
+  Py_INCREF(kids);
+  ob->children = kids;
+  return (PyObject *) ob;
+}
+
+static PyObject *
+api_maketoken(PyObject *maker, int type, const char *text, Py_ssize_t len,
+	      PyObject *position)
+{
+  PyObject *cls = api_class(maker, type);
+  SymbolObject *ob;
+  if (!cls) {
+    if (PyErr_Occurred()) {
+      return NULL;
+    }
+    return PyObject_CallFunction(maker, "(i,N,O)", type,
+				 PyString_FromStringAndSize(text, len),
+				 position);
+  }
+  if (!(ob = api_alloc(cls, (initproc) token_init))) {
+    if (PyErr_Occurred()) {
+      return NULL;
+    }
+    return PyObject_CallFunction(cls, "(i,N,O)", type,
+				 PyString_FromStringAndSize(text, len),
+				 position);
+  }
+  ob->type = type;
+  if (!(ob->string = PyString_FromStringAndSize(text, len))) {
+    Py_DECREF(ob);
+    return NULL;
+  }
+  Py_INCREF(position);
+  ob->position = position;
+  return (PyObject *) ob;
+}
+
+/*
+ * Check that a node's class uses our method for name.
+ */
+static int
+own_method(PyObject *ob, PyObject *name, PyObject *descr)
+{
+  return PyObject_TypeCheck(ob, &SymbolType)
+    && _PyType_Lookup(Py_TYPE(ob), name) == descr;
+}
+
+static int
+api_append(PyObject *ob, PyObject *child)
+{
+  if (!own_method(ob, appendname, appenddescr)) {
+    return 0;
+  }
+  if (!children((SymbolObject *) ob)
+      || PyList_Append(((SymbolObject *) ob)->children, child) < 0) {
+    return -1;
+  }
+  return 1;
+}
+
+static int
+api_insert(PyObject *ob, int idx, PyObject *child)
+{
+  if (!own_method(ob, insertname, insertdescr)) {
+    return 0;
+  }
+  if (!children((SymbolObject *) ob)
+      || PyList_Insert(((SymbolObject *) ob)->children, idx, child) < 0) {
+    return -1;
+  }
+  return 1;
+}
+
+/*
+ * Packed trees.
+ *
+ * Trees made in one process (a multiprocessing worker, say) are
+ * expensive to send to another through pickle.  pack(tree) writes a
+ * tree into one flat, relocatable string: a header, an array of
+ * nodes in post-order, an array of child indices, the token
+ * positions, the contexts (file name and stacked positions) that
+ * positions share, and a table of text.  Everything is located by
+ * offsets from the start, so the string can go into a file in shared
+ * memory and be mapped anywhere.  PackedTree(buffer) is a view of such a buffer that reads
+ * nodes out of it as they are asked for; nothing is copied up front.
+ * Numbers are in the byte order of the machine that packed the tree.
+ */
+#define PACK_MAGIC "cSymTre1"	/* Eight bytes; the last is a version */
+
+enum {PACK_SYMBOL, PACK_TOKEN, PACK_STRING, PACK_NONE};
+
+typedef struct {
+  char magic[8];		/* PACK_MAGIC */
+  int64_t nnodes;		/* Number of each item */
+  int64_t nkids;
+  int64_t npositions;
+  int64_t ncontexts;
+  int64_t nframes;
+  int64_t textlen;		/* Bytes of text */
+  int64_t root;			/* Index of the root node */
+  int64_t nodes;		/* Byte offsets of the tables */
+  int64_t kids;
+  int64_t positions;
+  int64_t contexts;
+  int64_t frames;
+  int64_t text;
+} packheader;
+
+typedef struct {
+  int32_t type;			/* Symbol or token type */
+  int32_t kind;			/* PACK_SYMBOL, ... */
+  int64_t kids;			/* First entry in the child indices */
+  int64_t nkids;		/* Number of children */
+  int64_t text;			/* Token or string text: offset and */
+  int64_t len;			/* length in the text table */
+  int64_t position;		/* Index of the token position, or -1 */
+} packednode;
+
+typedef struct {
+  int64_t pre_line;		/* As in the position tuple */
+  int64_t pre_col;
+  int64_t cur_line;
+  int64_t cur_col;
+  int64_t context;		/* Index of the context */
+} packedposition;
+
+typedef struct {
+  int64_t file;			/* File name in the text table */
+  int64_t filelen;
+  int64_t frames;		/* First stacked position */
+  int64_t nframes;
+} packedcontext;
+
+typedef struct {
+  int64_t file;			/* A stacked (file, line, col) */
+  int64_t filelen;
+  int64_t line;
+  int64_t col;
+} packedframe;
+
+/*
+ * A growable array, for building the tables.
+ */
+typedef struct {
+  char *data;
+  Py_ssize_t len;		/* Bytes used */
+  Py_ssize_t size;		/* Bytes allocated */
+} packbuf;
+
+static void *
+packbuf_grow(packbuf *b, Py_ssize_t n)
+{
+  void *p;
+  if (b->len + n > b->size) {
+    Py_ssize_t size = b->size ? b->size : 1024;
+    char *data;
+    while (size < b->len + n) {
+      size *= 2;
+    }
+    if (!(data = PyMem_Realloc(b->data, size))) {
+      PyErr_NoMemory();
+      return NULL;
+    }
+    b->data = data;
+    b->size = size;
+  }
+  p = b->data + b->len;
+  b->len += n;
+  return p;
+}
+
+typedef struct {
+  packbuf nodes, kids, positions, contexts, frames, text;
+  packbuf stack;		/* Indices of nodes awaiting parents */
+  PyObject *seen;		/* (file, stack) ids -> context index */
+  PyObject *lastfile;		/* The context found last time */
+  PyObject *laststack;
+  int64_t lastcontext;
+} packer;
+
+/*
+ * Add a string to the text table.
+ */
+static int
+pack_text(packer *pk, PyObject *s, int64_t *off, int64_t *len)
+{
+  char *p;
+  if (!PyString_Check(s)) {
+    PyErr_Format(PyExc_TypeError, "cannot pack text of type %.100s",
+		 Py_TYPE(s)->tp_name);
+    return -1;
+  }
+  if (!(p = packbuf_grow(&pk->text, PyString_GET_SIZE(s)))) {
+    return -1;
+  }
+  memcpy(p, PyString_AS_STRING(s), PyString_GET_SIZE(s));
+  *off = p - pk->text.data;
+  *len = PyString_GET_SIZE(s);
+  return 0;
+}
+
+/*
+ * Find or add the context of a position.  Tokens scanned from the
+ * same file share its name and stack, so each is packed once.
+ */
+static int64_t
+pack_context(packer *pk, PyObject *file, PyObject *stack)
+{
+  PyObject *key, *index;
+  packedcontext *c;
+  packedframe *f;
+  Py_ssize_t i, n;
+  int64_t result;
+  if (file == pk->lastfile && stack == pk->laststack) {
+    return pk->lastcontext;
+  }
+  if (!PyList_Check(stack) && !PyTuple_Check(stack)) {
+    PyErr_SetString(PyExc_TypeError, "cannot pack position stack");
+    return -1;
+  }
+  if (!(key = Py_BuildValue("(NN)", PyLong_FromVoidPtr(file),
+			    PyLong_FromVoidPtr(stack)))) {
+    return -1;
+  }
+  if ((index = PyDict_GetItem(pk->seen, key))) {
+    result = PyInt_AsLong(index);
+  } else {
+    result = pk->contexts.len / sizeof(packedcontext);
+    n = PySequence_Fast_GET_SIZE(stack);
+    if (!(c = packbuf_grow(&pk->contexts, sizeof(packedcontext)))
+	|| pack_text(pk, file, &c->file, &c->filelen) < 0) {
+      Py_DECREF(key);
+      return -1;
+    }
+    c->frames = pk->frames.len / sizeof(packedframe);
+    c->nframes = n;
+    for (i = 0; i < n; i++) {
+      PyObject *frame = PySequence_Fast_GET_ITEM(stack, i), *name;
+      PY_LONG_LONG line, col;
+      if (!PyTuple_Check(frame)) {
+	PyErr_SetString(PyExc_TypeError, "cannot pack position stack");
+      }
+      if (PyErr_Occurred()
+	  || !(f = packbuf_grow(&pk->frames, sizeof(packedframe)))
+	  || !PyArg_ParseTuple(frame, "SLL;cannot pack position stack",
+			       &name, &line, &col)
+	  || pack_text(pk, name, &f->file, &f->filelen) < 0) {
+	Py_DECREF(key);
+	return -1;
+      }
+      f->line = line;
+      f->col = col;
+    }
+    index = PyInt_FromLong((long) result);
+    if (!index || PyDict_SetItem(pk->seen, key, index) < 0) {
+      Py_XDECREF(index);
+      Py_DECREF(key);
+      return -1;
+    }
+    Py_DECREF(index);
+  }
+  Py_DECREF(key);
+  pk->lastfile = file;
+  pk->laststack = stack;
+  pk->lastcontext = result;
+  return result;
+}
+
+/*
+ * Fill in a token's text and position.
+ */
+static int
+pack_token(packer *pk, packednode *n, PyObject *string, PyObject *pos)
+{
+  PyObject *file, *stack;
+  PY_LONG_LONG pre_line, pre_col, cur_line, cur_col;
+  packedposition *p;
+  if (pack_text(pk, string, &n->text, &n->len) < 0) {
+    return -1;
+  }
+  if (pos == Py_None) {
+    return 0;
+  }
+  if (!PyTuple_Check(pos)) {
+    PyErr_SetString(PyExc_TypeError, "cannot pack position");
+    return -1;
+  }
+  if (!PyArg_ParseTuple(pos, "(LL)(LL)SO;cannot pack position",
+			&pre_line, &pre_col, &cur_line, &cur_col,
+			&file, &stack)
+      || !(p = packbuf_grow(&pk->positions, sizeof(packedposition)))
+      || (p->context = pack_context(pk, file, stack)) < 0) {
+    return -1;
+  }
+  p->pre_line = pre_line;
+  p->pre_col = pre_col;
+  p->cur_line = cur_line;
+  p->cur_col = cur_col;
+  n->position = p - (packedposition *) pk->positions.data;
+  return 0;
+}
+
+/*
+ * Pack one node, given the number of children already packed for it.
+ */
+static int
+pack_node(packer *pk, PyObject *node, Py_ssize_t arity)
+{
+  packednode *n;
+  int64_t *kids, *stack, index;
+  PyObject *string = NULL, *pos = NULL, *type;
+  int ok;
+  index = pk->nodes.len / sizeof(packednode);
+  if (!(n = packbuf_grow(&pk->nodes, sizeof(packednode)))) {
+    return -1;
+  }
+  memset(n, 0, sizeof(packednode));
+  n->position = -1;
+  if (PyString_Check(node)) {
+    n->kind = PACK_STRING;
+    ok = pack_text(pk, node, &n->text, &n->len);
+  } else if (node == Py_None) {
+    n->kind = PACK_NONE;
+    ok = 0;
+  } else {
+    if (PyObject_TypeCheck(node, &SymbolType)) {
+      n->type = ((SymbolObject *) node)->type;
+      string = ((SymbolObject *) node)->string;
+      pos = ((SymbolObject *) node)->position;
+      Py_XINCREF(string);
+      Py_XINCREF(pos);
+    } else {			/* Symbols.py, or something like it */
+      if (!(type = PyObject_GetAttrString(node, "type"))) {
+	if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
+	  PyErr_Clear();
+	  PyErr_Format(PyExc_TypeError, "cannot pack a %.100s",
+		       Py_TYPE(node)->tp_name);
+	}
+	return -1;
+      }
+      n->type = PyInt_AsLong(type);
+      Py_DECREF(type);
+      if (n->type == -1 && PyErr_Occurred()) {
+	return -1;
+      }
+      if ((string = PyObject_GetAttrString(node, "string"))
+	  && !(pos = PyObject_GetAttrString(node, "position"))) {
+	Py_CLEAR(string);
+      }
+      if (!string) {
+	if (!PyErr_ExceptionMatches(PyExc_AttributeError)) {
+	  return -1;
+	}
+	PyErr_Clear();
+      }
+    }
+    n->kind = string ? PACK_TOKEN : PACK_SYMBOL;
+    ok = string ? pack_token(pk, n, string, pos ? pos : Py_None) : 0;
+    Py_XDECREF(string);
+    Py_XDECREF(pos);
+  }
+  if (ok < 0) {
+    return -1;
+  }
+				/* The children are the last arity
+				   nodes on the stack */
+  n->nkids = arity;
+  n->kids = pk->kids.len / sizeof(int64_t);
+  if (arity) {
+    if (!(kids = packbuf_grow(&pk->kids, arity * sizeof(int64_t)))) {
+      return -1;
+    }
+    pk->stack.len -= arity * sizeof(int64_t);
+    memcpy(kids, pk->stack.data + pk->stack.len, arity * sizeof(int64_t));
+  }
+  if (!(stack = packbuf_grow(&pk->stack, sizeof(int64_t)))) {
+    return -1;
+  }
+  *stack = index;
+  return 0;
+}
+
+/*
+ * Copy a table into the packed string.
+ */
+static void
+pack_table(char *out, int64_t off, packbuf *b)
+{
+  if (b->len) {
+    memcpy(out + off, b->data, b->len);
+  }
+}
+
+#define PACK_ALIGN(n) (((n) + 7) & ~(int64_t) 7)
+
+static PyObject *
+c_pack(PyObject *self, PyObject *root)
+{
+  packer pk;
+  packheader h;
+  TreeIterObject *it;
+  PyObject *node, *result = NULL;
+  int64_t size;
+  memset(&pk, 0, sizeof(packer));
+  if (!(pk.seen = PyDict_New())) {
+    return NULL;
+  }
+  if (!(it = (TreeIterObject *) treeiter_new(root, 1))) {
+    Py_DECREF(pk.seen);
+    return NULL;
+  }
+  while ((node = treeiter_next(it))) {
+    int ok = pack_node(&pk, node, it->stack[it->depth].next);
+    Py_DECREF(node);
+    if (ok < 0) {
+      break;
+    }
+  }
+  Py_DECREF(it);
+  if (!PyErr_Occurred()) {
+    memset(&h, 0, sizeof(packheader));
+    memcpy(h.magic, PACK_MAGIC, sizeof(h.magic));
+    h.nnodes = pk.nodes.len / sizeof(packednode);
+    h.nkids = pk.kids.len / sizeof(int64_t);
+    h.npositions = pk.positions.len / sizeof(packedposition);
+    h.ncontexts = pk.contexts.len / sizeof(packedcontext);
+    h.nframes = pk.frames.len / sizeof(packedframe);
+    h.textlen = pk.text.len;
+    h.root = h.nnodes - 1;
+    h.nodes = PACK_ALIGN(sizeof(packheader));
+    h.kids = PACK_ALIGN(h.nodes + pk.nodes.len);
+    h.positions = PACK_ALIGN(h.kids + pk.kids.len);
+    h.contexts = PACK_ALIGN(h.positions + pk.positions.len);
+    h.frames = PACK_ALIGN(h.contexts + pk.contexts.len);
+    h.text = PACK_ALIGN(h.frames + pk.frames.len);
+    size = h.text + pk.text.len;
+    if ((result = PyString_FromStringAndSize(NULL, size))) {
+      char *out = PyString_AS_STRING(result);
+      memset(out, 0, size);
+      memcpy(out, &h, sizeof(packheader));
+      pack_table(out, h.nodes, &pk.nodes);
+      pack_table(out, h.kids, &pk.kids);
+      pack_table(out, h.positions, &pk.positions);
+      pack_table(out, h.contexts, &pk.contexts);
+      pack_table(out, h.frames, &pk.frames);
+      pack_table(out, h.text, &pk.text);
+    }
+  }
+  PyMem_Free(pk.nodes.data);
+  PyMem_Free(pk.kids.data);
+  PyMem_Free(pk.positions.data);
+  PyMem_Free(pk.contexts.data);
+  PyMem_Free(pk.frames.data);
+  PyMem_Free(pk.text.data);
+  PyMem_Free(pk.stack.data);
+  Py_DECREF(pk.seen);
+  return result;
+}
+
+/*
+ * A view of a packed tree.  The buffer may be anything with the
+ * buffer interface: the string from pack, an mmap of a file in
+ * /dev/shm, and so on.  Its address is looked up on each access,
+ * so a closed mmap raises an exception rather than crashing.
+ */
+typedef struct {
+  PyObject_HEAD
+  PyObject *buffer;		/* Holds the packed tree */
+  packheader h;			/* Its header, checked */
+  PyObject **contexts;		/* Contexts made so far, or NULL */
+} PackedTreeObject;
+
+typedef struct {
+  PyObject_HEAD
+  PackedTreeObject *tree;
+  int64_t index;		/* Node index */
+} PackedNodeObject;
+
+static PyTypeObject PackedTreeType;
+static PyTypeObject PackedNodeType;
+
+static const char *
+packed_data(PackedTreeObject *t)
+{
+  const void *data;
+  Py_ssize_t len;
+  if (PyObject_AsReadBuffer(t->buffer, &data, &len) < 0) {
+    return NULL;
+  }
+  if (len < t->h.text + t->h.textlen) {
+    PyErr_SetString(PyExc_ValueError, "packed tree buffer is too short");
+    return NULL;
+  }
+  return data;
+}
+
+/*
+ * Do n items of a size starting at off fit below limit?
+ */
+static int
+packed_range(int64_t off, int64_t n, int64_t size, int64_t limit)
+{
+  return off >= 0 && n >= 0 && off <= limit && n <= (limit - off) / size;
+}
+
+static const packednode *
+packed_node(PackedTreeObject *t, int64_t i)
+{
+  const char *data = packed_data(t);
+  const packednode *n;
+  if (!data) {
+    return NULL;
+  }
+  if (i < 0 || i >= t->h.nnodes) {
+    PyErr_SetString(PyExc_IndexError, "packed node index out of range");
+    return NULL;
+  }
+  n = (const packednode *) (data + t->h.nodes) + i;
+  if (n->kind < PACK_SYMBOL || n->kind > PACK_NONE) {
+    PyErr_SetString(PyExc_ValueError, "corrupt packed tree");
+    return NULL;
+  }
+  return n;
+}
+
+static PyObject *
+packed_text(PackedTreeObject *t, int64_t off, int64_t len)
+{
+  const char *data = packed_data(t);
+  if (!data) {
+    return NULL;
+  }
+  if (!packed_range(off, len, 1, t->h.textlen)) {
+    PyErr_SetString(PyExc_ValueError, "corrupt packed tree");
+    return NULL;
+  }
+  return PyString_FromStringAndSize(data + t->h.text + off, len);
+}
+
+/*
+ * The (file, stack) of a context, made once per tree so that tokens
+ * share them as they did when they were scanned.  Borrowed.
+ */
+static PyObject *
+packed_context(PackedTreeObject *t, int64_t i)
+{
+  const packedcontext *c;
+  const packedframe *f;
+  const char *data;
+  PyObject *ctx, *stack;
+  int64_t j;
+  if (i < 0 || i >= t->h.ncontexts) {
+    PyErr_SetString(PyExc_ValueError, "corrupt packed tree");
+    return NULL;
+  }
+  if (!t->contexts) {
+    t->contexts = PyMem_Malloc(t->h.ncontexts * sizeof(PyObject *));
+    if (!t->contexts) {
+      PyErr_NoMemory();
+      return NULL;
+    }
+    memset(t->contexts, 0, t->h.ncontexts * sizeof(PyObject *));
+  }
+  if (t->contexts[i]) {
+    return t->contexts[i];
+  }
+  if (!(data = packed_data(t))) {
+    return NULL;
+  }
+  c = (const packedcontext *) (data + t->h.contexts) + i;
+  if (!packed_range(c->frames, c->nframes, 1, t->h.nframes)) {
+    PyErr_SetString(PyExc_ValueError, "corrupt packed tree");
+    return NULL;
+  }
+  if (!(stack = PyList_New(c->nframes))) {
+    return NULL;
+  }
+  for (j = 0; j < c->nframes; j++) {
+    PyObject *frame;
+    f = (const packedframe *) (data + t->h.frames) + c->frames + j;
+    frame = Py_BuildValue("(N" LINECOL_FORMAT LINECOL_FORMAT ")",
+			  packed_text(t, f->file, f->filelen),
+			  (linecol) f->line, (linecol) f->col);
+    if (!frame) {
+      Py_DECREF(stack);
+      return NULL;
+    }
+    PyList_SET_ITEM(stack, j, frame);
+  }
+  ctx = Py_BuildValue("(NN)", packed_text(t, c->file, c->filelen), stack);
+  t->contexts[i] = ctx;
+  return ctx;
+}
+
+static PyObject *
+packed_position(PackedTreeObject *t, const packednode *n)
+{
+  const packedposition *p;
+  const char *data;
+  PyObject *ctx;
+  if (n->position < 0) {
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  if (!(data = packed_data(t))) {
+    return NULL;
+  }
+  if (n->position >= t->h.npositions) {
+    PyErr_SetString(PyExc_ValueError, "corrupt packed tree");
+    return NULL;
+  }
+  p = (const packedposition *) (data + t->h.positions) + n->position;
+  if (!(ctx = packed_context(t, p->context))) {
+    return NULL;
+  }
+  return Py_BuildValue("((" LINECOL_FORMAT LINECOL_FORMAT ")("
+		       LINECOL_FORMAT LINECOL_FORMAT ")OO)",
+		       (linecol) p->pre_line, (linecol) p->pre_col,
+		       (linecol) p->cur_line, (linecol) p->cur_col,
+		       PyTuple_GET_ITEM(ctx, 0), PyTuple_GET_ITEM(ctx, 1));
+}
+
+/*
+ * The view of node i: a PackedNode for a symbol or token, and the
+ * string or None itself for the other leaves.
+ */
+static PyObject *
+packed_view(PackedTreeObject *t, int64_t i)
+{
+  const packednode *n = packed_node(t, i);
+  PackedNodeObject *v;
+  if (!n) {
+    return NULL;
+  }
+  if (n->kind == PACK_STRING) {
+    return packed_text(t, n->text, n->len);
+  }
+  if (n->kind == PACK_NONE) {
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  if (!(v = PyObject_New(PackedNodeObject, &PackedNodeType))) {
+    return NULL;
+  }
+  Py_INCREF(t);
+  v->tree = t;
+  v->index = i;
+  return (PyObject *) v;
+}
+
+/*
+ * Child j of node n.
+ */
+static int64_t
+packed_kid(PackedTreeObject *t, const packednode *n, int64_t j)
+{
+  const char *data = packed_data(t);
+  int64_t k;
+  if (!data) {
+    return -1;
+  }
+  if (!packed_range(n->kids, n->nkids, 1, t->h.nkids)
+      || (k = ((const int64_t *) (data + t->h.kids))[n->kids + j]) < 0
+      || k >= t->h.nnodes) {
+    PyErr_SetString(PyExc_ValueError, "corrupt packed tree");
+    return -1;
+  }
+  return k;
+}
+
+/*
+ * Call gc.enable() or gc.disable(), returning whether the collector
+ * had been enabled.
+ */
+static int
+packed_gc(const char *call)
+{
+  PyObject *gc = PyImport_ImportModule("gc"), *was = NULL, *res = NULL;
+  int enabled = 0;
+  if (gc && (was = PyObject_CallMethod(gc, "isenabled", NULL))
+      && (res = PyObject_CallMethod(gc, (char *) call, NULL))) {
+    enabled = PyObject_IsTrue(was) > 0;
+  }
+  Py_XDECREF(res);
+  Py_XDECREF(was);
+  Py_XDECREF(gc);
+  PyErr_Clear();
+  return enabled;
+}
+
+/*
+ * Make the objects of the subtree at node i, with the same makers
+ * parse and onfile were given.  The subtree occupies the nodes from
+ * its leftmost leaf up to i, children before their parents, so it is
+ * built in one pass without recursion.  The cyclic collector is held
+ * off meanwhile: every object made is still in use, and collections
+ * triggered by making them would take most of the time.
+ */
+static PyObject *
+packed_materialize(PackedTreeObject *t, int64_t i, PyObject *maketoken,
+		   PyObject *makesymbol)
+{
+  const packednode *n;
+  PyObject **obs, *ob, *result = NULL;
+  int64_t first = i, j, k, c;
+  int collecting;
+  while ((n = packed_node(t, first)) && n->nkids > 0) {
+    if ((first = packed_kid(t, n, 0)) < 0) {
+      return NULL;
+    }
+  }
+  if (!n) {
+    return NULL;
+  }
+  if (first > i) {
+    PyErr_SetString(PyExc_ValueError, "corrupt packed tree");
+    return NULL;
+  }
+  if (!(obs = PyMem_Malloc((i - first + 1) * sizeof(PyObject *)))) {
+    return PyErr_NoMemory();
+  }
+  collecting = packed_gc("disable");
+  for (j = first; j <= i; j++) {
+    PyObject *kids = NULL, *text, *pos;
+    if (!(n = packed_node(t, j))) {
+      break;
+    }
+    if (n->nkids > 0) {
+      if (!(kids = PyList_New(n->nkids))) {
+	break;
+      }
+      for (c = 0; c < n->nkids; c++) {
+	if ((k = packed_kid(t, n, c)) < first || k >= j) {
+	  if (!PyErr_Occurred()) {
+	    PyErr_SetString(PyExc_ValueError, "corrupt packed tree");
+	  }
+	  break;
+	}
+	Py_INCREF(obs[k - first]);
+	PyList_SET_ITEM(kids, c, obs[k - first]);
+      }
+      if (PyErr_Occurred()) {
+	Py_DECREF(kids);
+	break;
+      }
+    }
+    switch (n->kind) {
+    case PACK_SYMBOL:
+      if (!kids && !(kids = PyList_New(0))) {
+	ob = NULL;
+	break;
+      }
+      ob = api_makesymbol(makesymbol, n->type, kids);
+      Py_CLEAR(kids);
+      break;
+    case PACK_TOKEN:
+      ob = NULL;
+      if ((text = packed_text(t, n->text, n->len))) {
+	if ((pos = packed_position(t, n))) {
+	  ob = api_maketoken(maketoken, n->type, PyString_AS_STRING(text),
+			     PyString_GET_SIZE(text), pos);
+	  Py_DECREF(pos);
+	}
+	Py_DECREF(text);
+      }
+      break;
+    default:
+      ob = packed_view(t, j);
+    }
+    if (ob && kids) {		/* A token with children */
+      for (c = 0; c < PyList_GET_SIZE(kids); c++) {
+	PyObject *kid = PyList_GET_ITEM(kids, c), *res;
+	int done = api_append(ob, kid);
+	if (done == 0) {
+	  res = PyObject_CallMethodObjArgs(ob, appendname, kid, NULL);
+	  done = res ? 1 : -1;
+	  Py_XDECREF(res);
+	}
+	if (done < 0) {
+	  Py_CLEAR(ob);
+	  break;
+	}
+      }
+    }
+    Py_XDECREF(kids);
+    if (!ob) {
+      break;
+    }
+    obs[j - first] = ob;
+  }
+  if (j > i) {
+    result = obs[i - first];
+    Py_INCREF(result);
+  }
+  while (--j >= first) {
+    Py_DECREF(obs[j - first]);
+  }
+  PyMem_Free(obs);
+  if (collecting) {
+    packed_gc("enable");
+  }
+  return result;
+}
+
+static PyObject *
+packednode_get_type(PackedNodeObject *v, void *closure)
+{
+  const packednode *n = packed_node(v->tree, v->index);
+  return n ? PyInt_FromLong(n->type) : NULL;
+}
+
+static PyObject *
+packednode_get_children(PackedNodeObject *v, void *closure)
+{
+  const packednode *n = packed_node(v->tree, v->index);
+  PyObject *list, *kid;
+  int64_t j, k;
+  if (!n || !(list = PyList_New(n->nkids))) {
+    return NULL;
+  }
+  for (j = 0; j < n->nkids; j++) {
+    if ((k = packed_kid(v->tree, n, j)) < 0
+	|| !(kid = packed_view(v->tree, k))) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, j, kid);
+  }
+  return list;
+}
+
+/*
+ * A symbol has no string or position, as with Symbol.
+ */
+static const packednode *
+packed_token(PackedNodeObject *v, const char *name)
+{
+  const packednode *n = packed_node(v->tree, v->index);
+  if (n && n->kind != PACK_TOKEN) {
+    PyErr_SetString(PyExc_AttributeError, name);
+    return NULL;
+  }
+  return n;
+}
+
+static PyObject *
+packednode_get_string(PackedNodeObject *v, void *closure)
+{
+  const packednode *n = packed_token(v, "string");
+  return n ? packed_text(v->tree, n->text, n->len) : NULL;
+}
+
+static PyObject *
+packednode_get_position(PackedNodeObject *v, void *closure)
+{
+  const packednode *n = packed_token(v, "position");
+  return n ? packed_position(v->tree, n) : NULL;
+}
+
+static PyObject *
+packednode_get_index(PackedNodeObject *v, void *closure)
+{
+  return PyInt_FromSsize_t((Py_ssize_t) v->index);
+}
+
+static PyObject *
+packednode_materialize(PackedNodeObject *v, PyObject *args)
+{
+  PyObject *maketoken, *makesymbol;
+  if (!PyArg_ParseTuple(args, "OO:materialize", &maketoken, &makesymbol)) {
+    return NULL;
+  }
+  return packed_materialize(v->tree, v->index, maketoken, makesymbol);
+}
+
+static void
+packednode_dealloc(PackedNodeObject *v)
+{
+  Py_DECREF(v->tree);
+  PyObject_Del(v);
+}
+
+static PyGetSetDef packednode_getset[] = {
+  {"type", (getter) packednode_get_type, NULL, "symbol or token type"},
+  {"children", (getter) packednode_get_children, NULL,
+   "views of the children"},
+  {"string", (getter) packednode_get_string, NULL, "token text"},
+  {"position", (getter) packednode_get_position, NULL, "token position"},
+  {"index", (getter) packednode_get_index, NULL,
+   "index of the node in the packed tree"},
+  {NULL}
+};
+
+static PyMethodDef packednode_methods[] = {
+  {"materialize", (PyCFunction) packednode_materialize, METH_VARARGS,
+   "materialize(maketoken, makesymbol) : make the objects of this subtree"},
+  {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject PackedNodeType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "cSymbols.PackedNode",	/* tp_name */
+  sizeof(PackedNodeObject),	/* tp_basicsize */
+  0,				/* tp_itemsize */
+  (destructor) packednode_dealloc, /* tp_dealloc */
+  0,				/* tp_print */
+  0,				/* tp_getattr */
+  0,				/* tp_setattr */
+  0,				/* tp_compare */
+  0,				/* tp_repr */
+  0,				/* tp_as_number */
+  0,				/* tp_as_sequence */
+  0,				/* tp_as_mapping */
+  0,				/* tp_hash */
+  0,				/* tp_call */
+  0,				/* tp_str */
+  0,				/* tp_getattro */
+  0,				/* tp_setattro */
+  0,				/* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT,		/* tp_flags */
+  "A node of a PackedTree, read from the buffer as needed",
+  0,				/* tp_traverse */
+  0,				/* tp_clear */
+  0,				/* tp_richcompare */
+  0,				/* tp_weaklistoffset */
+  0,				/* tp_iter */
+  0,				/* tp_iternext */
+  packednode_methods,		/* tp_methods */
+  0,				/* tp_members */
+  packednode_getset,		/* tp_getset */
+};
+
+static void
+packedtree_clearcontexts(PackedTreeObject *t)
+{
+  int64_t i;
+  if (t->contexts) {
+    for (i = 0; i < t->h.ncontexts; i++) {
+      Py_XDECREF(t->contexts[i]);
+    }
+    PyMem_Free(t->contexts);
+    t->contexts = NULL;
+  }
+}
+
+/*
+ * PackedTree(buffer): check the header and the table bounds once, so
+ * that only indices need checking later.
+ */
+static int
+packedtree_init(PackedTreeObject *t, PyObject *args, PyObject *kwds)
+{
+  PyObject *buffer, *old;
+  const void *data;
+  Py_ssize_t len;
+  packheader header, *h = &header;	/* Checked before it is used */
+  if (!PyArg_ParseTuple(args, "O:PackedTree", &buffer)
+      || PyObject_AsReadBuffer(buffer, &data, &len) < 0) {
+    return -1;
+  }
+  if (len < (Py_ssize_t) sizeof(packheader)
+      || memcmp(data, PACK_MAGIC, sizeof(h->magic)) != 0) {
+    PyErr_SetString(PyExc_ValueError, "not a packed tree");
+    return -1;
+  }
+  memcpy(h, data, sizeof(packheader));
+  if (h->nnodes < 1 || h->root != h->nnodes - 1
+      || !packed_range(h->nodes, h->nnodes, sizeof(packednode), len)
+      || !packed_range(h->kids, h->nkids, sizeof(int64_t), len)
+      || !packed_range(h->positions, h->npositions, sizeof(packedposition),
+		       len)
+      || !packed_range(h->contexts, h->ncontexts, sizeof(packedcontext), len)
+      || !packed_range(h->frames, h->nframes, sizeof(packedframe), len)
+      || !packed_range(h->text, h->textlen, 1, len)
+      || (h->nodes | h->kids | h->positions | h->contexts | h->frames) % 8) {
+    PyErr_SetString(PyExc_ValueError, "corrupt packed tree");
+    return -1;
+  }
+  packedtree_clearcontexts(t);	/* Those of any earlier tree */
+  t->h = header;
+  old = t->buffer;
+  Py_INCREF(buffer);
+  t->buffer = buffer;
+  Py_XDECREF(old);
+  return 0;
+}
+
+static void
+packedtree_dealloc(PackedTreeObject *t)
+{
+  packedtree_clearcontexts(t);
+  Py_XDECREF(t->buffer);
+  Py_TYPE(t)->tp_free((PyObject *) t);
+}
+
+static PyObject *
+packedtree_get_root(PackedTreeObject *t, void *closure)
+{
+  if (!t->buffer) {
+    PyErr_SetString(PyExc_ValueError, "uninitialized PackedTree");
+    return NULL;
+  }
+  return packed_view(t, t->h.root);
+}
+
+static PyObject *
+packedtree_node(PackedTreeObject *t, PyObject *args)
+{
+  PY_LONG_LONG i;
+  if (!PyArg_ParseTuple(args, "L:node", &i)) {
+    return NULL;
+  }
+  if (!t->buffer) {
+    PyErr_SetString(PyExc_ValueError, "uninitialized PackedTree");
+    return NULL;
+  }
+  return packed_view(t, i);
+}
+
+static PyObject *
+packedtree_materialize(PackedTreeObject *t, PyObject *args)
+{
+  PyObject *maketoken, *makesymbol;
+  if (!PyArg_ParseTuple(args, "OO:materialize", &maketoken, &makesymbol)) {
+    return NULL;
+  }
+  if (!t->buffer) {
+    PyErr_SetString(PyExc_ValueError, "uninitialized PackedTree");
+    return NULL;
+  }
+  return packed_materialize(t, t->h.root, maketoken, makesymbol);
+}
+
+static Py_ssize_t
+packedtree_length(PackedTreeObject *t)
+{
+  return t->buffer ? t->h.nnodes : 0;
+}
+
+static PySequenceMethods packedtree_as_sequence = {
+  (lenfunc) packedtree_length,	/* sq_length */
+};
+
+static PyGetSetDef packedtree_getset[] = {
+  {"root", (getter) packedtree_get_root, NULL, "view of the root node"},
+  {NULL}
+};
+
+static PyMethodDef packedtree_methods[] = {
+  {"node", (PyCFunction) packedtree_node, METH_VARARGS,
+   "node(index) : view of a node; nodes are numbered in post-order"},
+  {"materialize", (PyCFunction) packedtree_materialize, METH_VARARGS,
+   "materialize(maketoken, makesymbol) : make the objects of the tree"},
+  {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject PackedTreeType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "cSymbols.PackedTree",	/* tp_name */
+  sizeof(PackedTreeObject),	/* tp_basicsize */
+  0,				/* tp_itemsize */
+  (destructor) packedtree_dealloc, /* tp_dealloc */
+  0,				/* tp_print */
+  0,				/* tp_getattr */
+  0,				/* tp_setattr */
+  0,				/* tp_compare */
+  0,				/* tp_repr */
+  0,				/* tp_as_number */
+  &packedtree_as_sequence,	/* tp_as_sequence */
+  0,				/* tp_as_mapping */
+  0,				/* tp_hash */
+  0,				/* tp_call */
+  0,				/* tp_str */
+  0,				/* tp_getattro */
+  0,				/* tp_setattro */
+  0,				/* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT,		/* tp_flags */
+  "PackedTree(buffer) : view of a tree packed by pack(tree)",
+  0,				/* tp_traverse */
+  0,				/* tp_clear */
+  0,				/* tp_richcompare */
+  0,				/* tp_weaklistoffset */
+  0,				/* tp_iter */
+  0,				/* tp_iternext */
+  packedtree_methods,		/* tp_methods */
+  0,				/* tp_members */
+  packedtree_getset,		/* tp_getset */
+  0,				/* tp_base */
+  0,				/* tp_dict */
+  0,				/* tp_descr_get */
+  0,				/* tp_descr_set */
+  0,				/* tp_dictoffset */
+  (initproc) packedtree_init,	/* tp_init */
+  0,				/* tp_alloc */
+  PyType_GenericNew,		/* tp_new */
+};
+
+static SymbolsAPI module_api = {
+  &SymbolType, &TokenType,
+  api_makesymbol, api_maketoken, api_append, api_insert,
+};
+
+static PyMethodDef module_methods[] = {
+  {"position", c_position, METH_O,
+   "position(pos) : return a string describing a token location"},
+  {"preorder", c_preorder, METH_O,
+   "preorder(tree) : iterate over the nodes, parents first"},
+  {"postorder", c_postorder, METH_O,
+   "postorder(tree) : iterate over the nodes, children first"},
+  {"flatten", c_flatten, METH_O,
+   "flatten(tree) : return [(type, arity, node)] in post-order"},
+  {"pack", c_pack, METH_O,
+   "pack(tree) : return the tree packed into a string for PackedTree"},
+  {NULL, NULL, 0, NULL}
+};
+
+void
+initcSymbols(void)
+{
+  PyObject *names;
+  PyObject *pmod = Py_InitModule4("cSymbols", module_methods,
+				  "C Symbol and Token types", NULL,
+				  PYTHON_API_VERSION);
+  if (!pmod || PyType_Ready(&SymbolType) < 0 || PyType_Ready(&TokenType) < 0
+      || PyType_Ready(&FactoryType) < 0 || PyType_Ready(&TreeIterType) < 0
+      || PyType_Ready(&PackedTreeType) < 0
+      || PyType_Ready(&PackedNodeType) < 0) {
+    return;
+  }
+  appendname = PyString_InternFromString("append");
+  insertname = PyString_InternFromString("insert");
+  appenddescr = PyDict_GetItemString(SymbolType.tp_dict, "append");
+  insertdescr = PyDict_GetItemString(SymbolType.tp_dict, "insert");
+				/* Replace with names from the modules */
+  names = PyDict_New();
+  if (!names || PyDict_SetItemString(SymbolType.tp_dict, "names", names) < 0
+      || PyDict_SetItemString(TokenType.tp_dict, "names", names) < 0) {
+    Py_XDECREF(names);
+    return;
+  }
+  Py_DECREF(names);
+  PyType_Modified(&SymbolType);
+  PyType_Modified(&TokenType);
+  Py_INCREF(&SymbolType);
+  PyModule_AddObject(pmod, "Symbol", (PyObject *) &SymbolType);
+  Py_INCREF(&TokenType);
+  PyModule_AddObject(pmod, "Token", (PyObject *) &TokenType);
+  Py_INCREF(&FactoryType);
+  PyModule_AddObject(pmod, "Factory", (PyObject *) &FactoryType);
+  Py_INCREF(&PackedTreeType);
+  PyModule_AddObject(pmod, "PackedTree", (PyObject *) &PackedTreeType);
+  PyModule_AddObject(pmod, "CAPI",
+		     PyCapsule_New(&module_api, SYMBOLSAPI_CAPSULE, NULL));
+}
@@ -0,0 +1,97 @@
+/*
+        cSymbols.h -- C interface to the cSymbols Symbol and Token types
+
+        Copyright (c) 2002 by Tommy M. McGuire
+
+        Permission is hereby granted, free of charge, to any person
+        obtaining a copy of this software and associated documentation
+        files (the "Software"), to deal in the Software without
+        restriction, including without limitation the rights to use,
+        copy, modify, merge, publish, distribute, sublicense, and/or
+        sell copies of the Software, and to permit persons to whom
+        the Software is furnished to do so, subject to the following
+        conditions:
+
+        The above copyright notice and this permission notice shall be
+        included in all copies or substantial portions of the Software.
+
+        THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+        KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+        WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE
+        AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+        HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+        WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+        FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+        OTHER DEALINGS IN THE SOFTWARE.
+
+	Please report any problems to mcguire@cs.utexas.edu.
+
+	This is version 2.0.
+*/
+
+#ifndef CSYMBOLS_H
+#define CSYMBOLS_H
+
+#include "Python.h"
+
+/*
+ * Symbols and tokens share one layout, so that a class may derive
+ * from both (as Symbols.Token does).  A symbol has no string or
+ * position; children is only created when first needed, since most
+ * tokens never have any.
+ */
+typedef struct {
+  PyObject_HEAD
+  int type;			/* Symbol or token type */
+  PyObject *children;		/* List of children, or NULL */
+  PyObject *string;		/* Token text, or NULL */
+  PyObject *position;		/* Token position, or NULL */
+} SymbolObject;
+
+/*
+ * The cSymbols module publishes a SymbolsAPI in its capsule "CAPI".
+ * FlexModule and BisonModule pick it up when they are initialized, if
+ * cSymbols can be imported, and use it instead of calling maketoken,
+ * makesymbol, append and insert through Python.
+ */
+#define SYMBOLSAPI_CAPSULE "cSymbols.CAPI"
+
+typedef struct {
+  PyTypeObject *symboltype;	/* cSymbols.Symbol */
+  PyTypeObject *tokentype;	/* cSymbols.Token */
+				/* maker(type, children); maker may be
+				   a Factory, a class or anything
+				   callable.  Returns a new reference. */
+  PyObject *(*makesymbol)(PyObject *maker, int type, PyObject *children);
+				/* maker(type, text, position) */
+  PyObject *(*maketoken)(PyObject *maker, int type, const char *text,
+			 Py_ssize_t len, PyObject *position);
+				/* symbol.append(child) and
+				   symbol.insert(index, child), if
+				   symbol is a cSymbols node whose
+				   class does not override them;
+				   return 1 if done, 0 if the caller
+				   should call the method itself, -1
+				   on error */
+  int (*append)(PyObject *symbol, PyObject *child);
+  int (*insert)(PyObject *symbol, int index, PyObject *child);
+} SymbolsAPI;
+
+#ifndef CSYMBOLS_MODULE
+static SymbolsAPI *symbolsapi = NULL;
+
+/*
+ * Look for cSymbols; it is optional, so failing to find it is not an
+ * error.
+ */
+static void
+import_symbols(void)
+{
+  symbolsapi = (SymbolsAPI *) PyCapsule_Import(SYMBOLSAPI_CAPSULE, 0);
+  if (!symbolsapi) {
+    PyErr_Clear();
+  }
+}
+#endif
+
+#endif /* CSYMBOLS_H */
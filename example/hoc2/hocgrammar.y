@@ -52,6 +52,18 @@
 %left '*' '/'
 %left UNARYMINUS
 
+	/* Locations are not used by the actions; asking for them
+	   gives BisonModule's profiler (BISONMODULE_PROFILE) a hook
+	   on every reduction. */
+%locations
+
+	/* Tokens bison throws away while recovering from a syntax
+	   error are dropped at once, rather than at the end of the
+	   parse.  Only tokens every rule keeps are listed, or bison
+	   warns about the newlines and parentheses the rules drop;
+	   those go when BisonModule sweeps its buffer. */
+%destructor { DISCARD($$); } NUMBER VAR '=' '+' '-' '*' '/'
+
 	/* Just to be unambiguous, start with "start". */
 %start start
 
@@ -0,0 +1,105 @@
+%{
+/*
+	hocnative.y -- hoc, evaluating as it parses
+
+        Copyright (c) 2002 by Tommy M. McGuire
+
+        Permission is hereby granted, free of charge, to any person
+        obtaining a copy of this software and associated documentation
+        files (the "Software"), to deal in the Software without
+        restriction, including without limitation the rights to use,
+        copy, modify, merge, publish, distribute, sublicense, and/or
+        sell copies of the Software, and to permit persons to whom
+        the Software is furnished to do so, subject to the following
+        conditions:
+
+        The above copyright notice and this permission notice shall be
+        included in all copies or substantial portions of the Software.
+
+        THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+        KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+        WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE
+        AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+        HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+        WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+        FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+        OTHER DEALINGS IN THE SOFTWARE.
+
+	Please report any problems to mcguire@cs.utexas.edu.
+
+	This is version 2.0.
+*/
+
+/*
+	The hoc grammar again, but with BISONMODULE_NATIVE: the
+	expressions are computed in C as they are parsed, as in
+	Kernighan and Pike's hoc2, and only their values (and any
+	syntax errors) go into the LIST.  It uses hoclexer, so the
+	tokens are declared in the same order as in hocgrammar.y
+	to get the same numbers.
+*/
+#define BISONMODULE_NATIVE
+#include "BisonModule.h"
+
+	/* Symbol types */
+#define LIST	1000
+
+static double mem[26];		/* Memory for the variables a to z */
+
+	/* Variables are single lower case letters (see hoclexer.l) */
+#define MEM(var) mem[TOKENTEXT(var)[0] - 'a']
+%}
+
+	/* Tokens and the list are objects; expressions are doubles. */
+%token <ob> NUMBER
+%token <ob> VAR
+%type <ob> list
+%type <d> expr
+%right '='
+%left '+' '-'
+%left '*' '/'
+%left UNARYMINUS
+
+	/* As in hocgrammar.y, for the sweep of BisonModule's buffer;
+	   here it also drops the tokens the expressions have been
+	   computed from. */
+%locations
+
+%destructor { DISCARD($$); } <ob>
+
+%start start
+
+%%
+
+start:		list			{ RETURNTREE($1); }
+
+	/* Each line's value is boxed as a float where it joins the
+	   list. */
+list:		/* nothing */		{ $$ = REDUCE(LIST); }
+		| list '\n'		{ $$ = $1; }
+		| list expr '\n'	{ $$ = REDUCELEFT($1, BOXDOUBLE($2)); }
+		| list error '\n'	{ $$ = REDUCELEFT($1, REDUCEERROR); }
+		;
+
+	/* No objects are made here: a number is converted from the
+	   text of its token, and a variable is looked up by it. */
+expr:		NUMBER			{ $$ = TOKENDOUBLE($1); }
+		| VAR			{ $$ = MEM($1); }
+		| VAR '=' expr		{ $$ = MEM($1) = $3; }
+		| expr '+' expr		{ $$ = $1 + $3; }
+		| expr '-' expr		{ $$ = $1 - $3; }
+		| expr '*' expr		{ $$ = $1 * $3; }
+		| expr '/' expr		{ $$ = $1 / $3; }
+		| '(' expr ')'		{ $$ = $2; }
+		| '-' expr %prec UNARYMINUS
+					{ $$ = -$2; }
+		;
+
+%%
+
+static SymbolValues module_symbols[] = {
+	{"LIST", LIST},
+	{0,0}
+};
+
+BISONMODULEINIT(hocnative, module_symbols);
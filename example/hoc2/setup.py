@@ -11,19 +11,39 @@ call(['flex', '-o', 'hoclexer.c', 'hoclexer.l'])
 # bison -v -t -d -o hocgrammar.c hocgrammar.y
 call(['bison', '-v', '-t', '-d', '-o', 'hocgrammar.c', 'hocgrammar.y'])
 
+# The same grammar computing in C (BISONMODULE_NATIVE); it uses hoclexer,
+# so it needs no header of its own
+# bison -v -t -o hocnative.c hocnative.y
+call(['bison', '-v', '-t', '-o', 'hocnative.c', 'hocnative.y'])
+
 hoclexer = Extension('hoclexer',
                      sources = ['hoclexer.c'],
                      include_dirs = ['../..'],
+                     define_macros = [('FLEXMODULE_STATS', None),
+                                      ('FLEXMODULE_GZIP', None)],
+                     libraries = ['z'],
                      depends = ['hoclexer.l', 'hocgrammar.h'])
 
 hocgrammar = Extension('hocgrammar',
                        sources = ['hocgrammar.c'],
                        include_dirs = ['../..'],
+                       define_macros = [('BISONMODULE_STATS', None)],
                        depends = ['hocgrammar.y', 'hocgrammar.h'])
 
+hocnative = Extension('hocnative',
+                      sources = ['hocnative.c'],
+                      include_dirs = ['../..'],
+                      define_macros = [('BISONMODULE_STATS', None)],
+                      depends = ['hocnative.y'])
+
+cSymbols = Extension('cSymbols',
+                     sources = ['../../cSymbols.c'],
+                     include_dirs = ['../..'],
+                     depends = ['../../cSymbols.h'])
+
 setup (name = 'hoc',
        version = '1.0',
        description = 'calculator based on The Unix Programming Environment',
        author = 'Tommy M. McGuire',
-       ext_modules = [hoclexer, hocgrammar])
+       ext_modules = [hoclexer, hocgrammar, hocnative, cSymbols])
 